@@ -0,0 +1,149 @@
+/* arena.h                                                         -*- C++ -*-
+   Jeremy Barnes, 22 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Bump allocator for short-lived memory.
+*/
+
+#ifndef __jmvcc__arena_h__
+#define __jmvcc__arena_h__
+
+#include "jml/compiler/compiler.h"
+#include <boost/utility.hpp>
+#include <algorithm>
+#include <vector>
+#include <stdlib.h>
+#include <new>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* ARENA                                                                     */
+/*****************************************************************************/
+
+/** Memory is handed out by bumping a pointer, and is all given back at once
+    by reset(); there is no way to free a single allocation.  The first few
+    hundred bytes live inside the arena itself, so that a small amount of
+    memory can be used without ever calling malloc().
+*/
+
+struct Arena : boost::noncopyable {
+    Arena()
+        : pos(first.bytes), end(first.bytes + INLINE_SIZE), used(0)
+    {
+    }
+
+    ~Arena()
+    {
+        for (unsigned i = 0;  i < blocks.size();  ++i)
+            free(blocks[i]);
+        release_large_blocks();
+    }
+
+    void * allocate(size_t bytes, size_t alignment)
+    {
+        char * result = align(pos, alignment);
+        if (JML_UNLIKELY(result + bytes > end))
+            result = new_block(bytes, alignment);
+        pos = result + bytes;
+        return result;
+    }
+
+    template<typename T>
+    T * allocate()
+    {
+        return reinterpret_cast<T *>(allocate(sizeof(T), __alignof__(T)));
+    }
+
+    /** Forget everything that was allocated.  Destructors are not called.
+        Up to MAX_KEPT_BLOCKS ordinary blocks are kept to be used again, so
+        that an arena that is reset over and over doesn't go back to
+        malloc() each time; larger ones are freed. */
+    void reset()
+    {
+        for (unsigned i = MAX_KEPT_BLOCKS;  i < blocks.size();  ++i)
+            free(blocks[i]);
+        if (blocks.size() > MAX_KEPT_BLOCKS)
+            blocks.resize(MAX_KEPT_BLOCKS);
+        release_large_blocks();
+
+        used = 0;
+        pos = first.bytes;
+        end = first.bytes + INLINE_SIZE;
+    }
+
+private:
+    enum {
+        INLINE_SIZE = 256,
+        BLOCK_SIZE = 4096,
+        MAX_KEPT_BLOCKS = 16
+    };
+
+    union {
+        char bytes[INLINE_SIZE];
+        double align_double;
+        void * align_pointer;
+        long long align_long_long;
+    } first;
+
+    char * pos;
+    char * end;
+
+    /// Blocks of BLOCK_SIZE allocated once the inline space ran out.  The
+    /// first used of them are in use; the rest were kept by reset().
+    std::vector<char *> blocks;
+    unsigned used;
+
+    /// Blocks too big for BLOCK_SIZE, which aren't kept
+    std::vector<char *> large_blocks;
+
+    static char * align(char * p, size_t alignment)
+    {
+        size_t mask = alignment - 1;
+        return reinterpret_cast<char *>((reinterpret_cast<size_t>(p) + mask)
+                                        & ~mask);
+    }
+
+    static char * allocate_block(size_t size)
+    {
+        char * block = reinterpret_cast<char *>(malloc(size));
+        if (!block) throw std::bad_alloc();
+        return block;
+    }
+
+    char * new_block(size_t bytes, size_t alignment)
+    {
+        size_t size = bytes + alignment;
+        char * block;
+
+        if (size > BLOCK_SIZE) {
+            large_blocks.reserve(large_blocks.size() + 1);
+            block = allocate_block(size);
+            large_blocks.push_back(block);
+        }
+        else {
+            size = BLOCK_SIZE;
+            if (used == blocks.size()) {
+                blocks.reserve(blocks.size() + 1);
+                blocks.push_back(allocate_block(size));
+            }
+            block = blocks[used++];
+        }
+
+        end = block + size;
+        return align(block, alignment);
+    }
+
+    void release_large_blocks()
+    {
+        for (unsigned i = 0;  i < large_blocks.size();  ++i)
+            free(large_blocks[i]);
+        large_blocks.clear();
+    }
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__arena_h__ */
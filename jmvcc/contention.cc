@@ -0,0 +1,73 @@
+/* contention.cc
+   Jeremy Barnes, 20 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Implementation of contention management.
+*/
+
+#include "contention.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+using namespace std;
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* CONTENTION_MANAGER                                                        */
+/*****************************************************************************/
+
+Contention_Manager::
+~Contention_Manager()
+{
+}
+
+
+/*****************************************************************************/
+/* BACKOFF_MANAGER                                                           */
+/*****************************************************************************/
+
+/// Per thread random seed, so that backing off doesn't contend on the lock
+/// inside random()
+__thread unsigned backoff_seed = 0;
+
+Backoff_Manager::
+Backoff_Manager(const Backoff_Policy & policy)
+    : policy(policy)
+{
+}
+
+Retry_Action
+Backoff_Manager::
+after_failure(const Transaction & trans)
+{
+    int failures = trans.retries();
+
+    if (policy.max_retries != -1 && failures > policy.max_retries)
+        return GIVE_UP;
+
+    if (policy.serialize_after != -1 && failures >= policy.serialize_after)
+        return RETRY_SERIALIZED;
+
+    // Double the longest wait each time, being careful not to overflow
+    int max_wait = policy.initial_backoff_us;
+    for (int i = 1;  i < failures && max_wait < policy.max_backoff_us;  ++i)
+        max_wait *= 2;
+    max_wait = std::min(max_wait, policy.max_backoff_us);
+
+    if (max_wait <= 0) return RETRY;
+
+    if (backoff_seed == 0)
+        backoff_seed = (unsigned)(size_t)&backoff_seed ^ getpid();
+
+    int wait = rand_r(&backoff_seed) % (max_wait + 1);
+    if (wait > 0) usleep(wait);
+
+    return RETRY;
+}
+
+} // namespace JMVCC
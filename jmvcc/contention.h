@@ -0,0 +1,150 @@
+/* contention.h                                                    -*- C++ -*-
+   Jeremy Barnes, 20 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Contention management: what to do when a transaction fails to commit.
+*/
+
+#ifndef __jmvcc__contention_h__
+#define __jmvcc__contention_h__
+
+#include "transaction.h"
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* CONTENTION_MANAGER                                                        */
+/*****************************************************************************/
+
+/// What to do once a transaction has failed to commit
+enum Retry_Action {
+    RETRY,             ///< Run the transaction again
+    RETRY_SERIALIZED,  ///< Run it again with all other commits stopped
+    GIVE_UP            ///< Stop trying
+};
+
+/** Decides what happens to a transaction that failed to commit.  It is
+    called once after each failure, and may wait (for example to back off)
+    before it returns.  The number of failures so far is available from
+    trans.retries().
+*/
+struct Contention_Manager {
+    virtual ~Contention_Manager();
+
+    virtual Retry_Action after_failure(const Transaction & trans) = 0;
+};
+
+
+/*****************************************************************************/
+/* BACKOFF_POLICY                                                            */
+/*****************************************************************************/
+
+/// Parameters for the default contention manager
+struct Backoff_Policy {
+    Backoff_Policy()
+        : initial_backoff_us(1), max_backoff_us(1000),
+          max_retries(-1), serialize_after(-1)
+    {
+    }
+
+    int initial_backoff_us;  ///< Longest wait after the first failure
+    int max_backoff_us;      ///< Never wait longer than this
+    int max_retries;         ///< Give up after this many; -1 means never
+    int serialize_after;     ///< Serialize after this many; -1 means never
+};
+
+
+/*****************************************************************************/
+/* BACKOFF_MANAGER                                                           */
+/*****************************************************************************/
+
+/** Contention manager that waits for a random time after each failure.  The
+    longest possible wait doubles each time, up to a maximum.  The
+    transaction is serialized or abandoned after a given number of
+    failures.
+*/
+struct Backoff_Manager : public Contention_Manager {
+    Backoff_Manager(const Backoff_Policy & policy = Backoff_Policy());
+
+    virtual Retry_Action after_failure(const Transaction & trans);
+
+    Backoff_Policy policy;
+};
+
+
+/*****************************************************************************/
+/* RUN_TRANSACTION                                                           */
+/*****************************************************************************/
+
+/** Run fn() in a transaction until it commits or the contention manager
+    tells us to give up.  Returns true if it committed.  In serialized mode,
+    the commit lock is held for writing over both fn() and the commit, and
+    the transaction is immune to being doomed or barged by other writers,
+    so the commit can't conflict with anything.
+
+    When called inside another transaction, fn() is run once in a
+    Nested_Transaction that joins it instead of in a transaction of its
+    own, and its work is committed along with the outer transaction's;
+    retrying is then up to the outer transaction.  Library code that
+    might be called inside a transaction should use this or a
+    Nested_Transaction rather than a Local_Transaction, which always
+    registers its own snapshot and commits on its own.
+
+    fn() must not commit a transaction of its own (such as a
+    Local_Transaction) or call compress_epochs(): with the commit lock
+    held, that would deadlock, and so it throws.
+*/
+template<class Fn>
+bool run_transaction(Fn fn, Contention_Manager & manager)
+{
+    if (current_trans) {
+        Nested_Transaction nested;
+        fn();
+        return nested.commit();
+    }
+
+    Local_Transaction trans;
+    trans.set_reuse_on_retry(true);
+
+    for (;;) {
+        fn();
+        if (trans.commit()) return true;
+
+        Retry_Action action = manager.after_failure(trans);
+
+        if (action == GIVE_UP) return false;
+        if (action == RETRY) continue;
+
+        // Serialized: stop everything else from committing, then move up
+        // to the latest epoch so that nothing can conflict with us
+        Epoch committed;
+        {
+            Exclusive_Commit_Guard guard;
+            trans.set_immune(true);
+            trans.set_epoch(get_current_epoch());
+
+            fn();
+            committed = trans.commit_locked();
+            trans.set_immune(false);
+        }
+
+        trans.run_hooks(committed);
+
+        // Fails only if fn() itself made the commit impossible
+        return committed;
+    }
+}
+
+template<class Fn>
+bool run_transaction(Fn fn, const Backoff_Policy & policy = Backoff_Policy())
+{
+    Backoff_Manager manager(policy);
+    return run_transaction(fn, manager);
+}
+
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__contention_h__ */
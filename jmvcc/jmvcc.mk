@@ -3,7 +3,8 @@ JMVCC_SOURCES := \
 	sandbox.cc \
 	transaction.cc \
 	versioned_object.cc \
-	garbage.cc
+	garbage.cc \
+	contention.cc
 
 JMVCC_LINK :=  boost_date_time-mt
 
@@ -8,17 +8,35 @@
 #include "sandbox.h"
 #include "transaction.h"
 #include "jml/arch/atomic_ops.h"
+#include <ace/Thread_Mutex.h>
+#include <ace/Condition_Thread_Mutex.h>
+#include <algorithm>
 
 
 using namespace std;
 
 namespace JMVCC {
 
+/// Has any sandbox been given a priority?
+volatile bool priorities_in_use = false;
+
+/// Do commits doom the other writers of their objects?
+volatile bool early_doom = false;
+
 
 /*****************************************************************************/
 /* SANDBOX                                                                   */
 /*****************************************************************************/
 
+Sandbox::
+Sandbox()
+    : serializable(false), priority_(0), doomed_(false), immune_(false),
+      registered_(false),
+      savepoint_(0), last_savepoint_(0), stale_count(0),
+      reuse_on_retry_(false), read_cache_epoch_(0), cache_reads_(false)
+{
+}
+
 Sandbox::
 ~Sandbox()
 {
@@ -29,34 +47,474 @@ void
 Sandbox::
 clear()
 {
+    // Must be done before local_values is cleared, as it says where we
+    // are registered
+    if (registered_)
+        unregister_writers();
+
     for (Local_Values::iterator
              it = local_values.begin(),
              end = local_values.end();
+         it != end;  ++it)
+        if (it->second.val) it->second.destroy(it->second.val);
+
+    local_values.clear();
+    stale_count = 0;
+    reads.clear();
+    read_cache.clear();
+    doomed_ = false;
+
+    discard_undo(0);
+    savepoint_ = last_savepoint_ = 0;
+
+    // Everything in the local values and the undo log is now gone
+    arena.reset();
+}
+
+Sandbox::Savepoint
+Sandbox::
+savepoint()
+{
+    Savepoint result;
+    result.number = ++last_savepoint_;
+    result.previous = savepoint_;
+    result.undo_size = undo_log.size();
+    savepoint_ = result.number;
+    return result;
+}
+
+void
+Sandbox::
+rollback_to(const Savepoint & savepoint)
+{
+    if (savepoint.number != savepoint_)
+        throw Exception("savepoints must be ended in reverse order");
+
+    bool any_removed = false;
+
+    // Undo in reverse order, so that an object saved more than once ends
+    // up with its oldest value
+    while (undo_log.size() > savepoint.undo_size) {
+        const Undo_Entry & undo = undo_log.back();
+
+        Local_Values::iterator it = local_values.find(undo.obj);
+        if (it == local_values.end())
+            throw Exception("rollback_to(): local value disappeared");
+
+        undo.destroy(it->second.val);
+        it->second.val = undo.old_val;
+        it->second.savepoint = undo.savepoint;
+        if (!undo.old_val) any_removed = true;
+
+        undo_log.pop_back();
+    }
+
+    // Get rid of the values that were created after the savepoint
+    if (any_removed)
+        compact();
+
+    savepoint_ = savepoint.previous;
+}
+
+void
+Sandbox::
+compact()
+{
+    std::vector<std::pair<Versioned_Object *, Entry> > kept;
+    kept.reserve(local_values.size());
+
+    for (Local_Values::const_iterator
+             it = local_values.begin(),
+             end = local_values.end();
          it != end;  ++it) {
-        free(it->second.val);
+        if (it->second.val && !it->second.stale) {
+            kept.push_back(*it);
+            continue;
+        }
+
+        // Rolled back values have already been destroyed
+        if (it->second.val) it->second.destroy(it->second.val);
+        if (registered_) unregister_writer(it->first);
     }
+
     local_values.clear();
+    for (unsigned i = 0;  i < kept.size();  ++i)
+        local_values.insert(kept[i]);
+
+    stale_count = 0;
+}
+
+void
+Sandbox::
+release(const Savepoint & savepoint)
+{
+    if (savepoint.number != savepoint_)
+        throw Exception("savepoints must be ended in reverse order");
+
+    savepoint_ = savepoint.previous;
+
+    // An enclosing savepoint still needs our undo entries to roll back
+    // through us; otherwise there's nothing left that can use them
+    if (savepoint_ == 0)
+        discard_undo(0);
+}
+
+void
+Sandbox::
+discard_undo(size_t new_size)
+{
+    for (unsigned i = new_size;  i < undo_log.size();  ++i)
+        if (undo_log[i].old_val)
+            undo_log[i].destroy(undo_log[i].old_val);
+    undo_log.resize(new_size);
+}
+
+struct Compare_Objects {
+    template<class Pair>
+    bool operator () (const Pair & p1, const Pair & p2) const
+    {
+        return p1.first < p2.first;
+    }
+};
+
+template<class Iterator>
+void rollback_range(Iterator first, Iterator last, Epoch new_epoch)
+{
+    for (; first != last;  ++first)
+        first->first->rollback(new_epoch, first->second.val);
 }
 
+/** Call setup() on each of the objects in the range.  If one of them fails
+    or throws, the ones that were already set up are rolled back and false
+    is returned or the exception is rethrown. */
+template<class Iterator>
+bool setup_range(Iterator first, Iterator last,
+                 Epoch old_epoch, Epoch new_epoch)
+{
+    bool result = true;
+
+    Iterator it = first;
+    try {
+        for (; result && it != last;  ++it)
+            result = it->first->setup(old_epoch, new_epoch, it->second.val);
+    } catch (...) {
+        // it is the one that threw
+        rollback_range(first, it, new_epoch);
+        throw;
+    }
+
+    if (result) return true;
+
+    // Rollback any that were set up if there was a problem
+    rollback_range(first, boost::prior(it), new_epoch);
+
+    return false;
+}
+
+template<class Iterator>
+void commit_range(Iterator first, Iterator last, Epoch new_epoch)
+{
+    for (; first != last;  ++first)
+        first->first->commit(new_epoch);
+}
+
+/** Holds the commit locks of the given objects, which must be in address
+    order, until it goes out of scope. */
+struct Object_Locks : boost::noncopyable {
+    Object_Locks(const std::vector<Versioned_Object *> & objects)
+        : objects(objects)
+    {
+        for (unsigned i = 0;  i < objects.size();  ++i)
+            objects[i]->object_commit_lock.acquire();
+    }
+
+    ~Object_Locks()
+    {
+        for (unsigned i = 0;  i < objects.size();  ++i)
+            objects[i]->object_commit_lock.release();
+    }
+
+    const std::vector<Versioned_Object *> & objects;
+};
+
+/** An epoch reserved for a commit.  If it hasn't been published by the time
+    it goes out of scope, for example because a setup() threw, it is
+    released so that the later commits waiting for it can go ahead. */
+struct Reserved_Epoch : boost::noncopyable {
+    Reserved_Epoch()
+        : epoch(reserve_epoch()), published(false)
+    {
+    }
+
+    ~Reserved_Epoch()
+    {
+        if (!published) release_epoch(epoch);
+    }
+
+    void publish()
+    {
+        publish_epoch(epoch);
+        published = true;
+    }
+
+    Epoch epoch;
+    bool published;
+};
+
+struct Sandbox::Commit_Request {
+    Commit_Request(Sandbox * sandbox, Epoch old_epoch)
+        : sandbox(sandbox), old_epoch(old_epoch), result(0), done(false),
+          threw(false)
+    {
+    }
+
+    Sandbox * sandbox;
+    Epoch old_epoch;
+    Epoch result;
+    bool done;
+
+    /// Setting up our objects threw; the exception is thrown again in
+    /// our own thread, not in that of whoever led the group
+    bool threw;
+    std::string error;
+
+    void rethrow() const
+    {
+        if (threw) throw Exception(error);
+    }
+};
+
 Epoch
 Sandbox::
 commit(Epoch old_epoch)
 {
-    ACE_Guard<ACE_Mutex> guard(commit_lock);
+    return do_commit(old_epoch, false /* lock_held */);
+}
 
-    Epoch new_epoch = get_current_epoch() + 1;
+Epoch
+Sandbox::
+commit_locked(Epoch old_epoch)
+{
+    return do_commit(old_epoch, true /* lock_held */);
+}
 
-    bool result = true;
+Epoch
+Sandbox::
+do_commit(Epoch old_epoch, bool lock_held)
+{
+    // Values left over from a failed attempt that weren't written this
+    // time around aren't part of the commit
+    if (JML_UNLIKELY(stale_count != 0)) {
+        if (stale_count == local_values.size()) {
+            // Being doomed on this attempt still counts
+            bool doomed = doomed_;
+            clear();
+            doomed_ = doomed;
+        }
+        else compact();
+    }
+
+    // Nothing written means nothing to check or install, and so there is
+    // no need for the lock or for a new epoch: the transaction happened
+    // at the epoch of its snapshot.
+    if (local_values.empty()) {
+        reads.clear();
+
+        // Unless what was read wasn't all from that epoch, which dooms a
+        // lazily registered snapshot
+        if (JML_UNLIKELY(doomed_)) {
+            failed();
+            return 0;
+        }
+
+        return old_epoch;
+    }
+
+    // Before we lock anything, see if we can tell that we're going to fail
+    if (doomed_ || !precheck(old_epoch)) {
+        failed();
+        return 0;
+    }
+
+    // Give way to a higher priority writer of our objects.  Lower
+    // priority ones are only doomed once our setup has succeeded, so that
+    // a commit that then fails doesn't take them down with it.
+    if (registered_ && priorities_in_use && outranked()) {
+        failed();
+        return 0;
+    }
+
+    Epoch result;
+    try {
+        if (lock_held) {
+            Commit_Request request(this, old_epoch);
+            install_group(std::vector<Commit_Request *>(1, &request));
+            request.rethrow();
+            result = request.result;
+        }
+        else if (get_commit_mode() == GROUP_COMMIT)
+            result = commit_grouped(old_epoch);
+        else result = commit_parallel(old_epoch);
+    } catch (...) {
+        // Nothing was committed
+        failed();
+        throw;
+    }
+
+    // TODO: clear as we go to better use cache
+    if (result) clear();
+    else failed();
+
+    return result;
+}
+
+void
+Sandbox::
+failed()
+{
+    if (!reuse_on_retry_) {
+        clear();
+        return;
+    }
+
+    // Keep the values and their memory, but they no longer mean anything
+    // until they're written again
+    if (registered_)
+        unregister_writers();
+
+    for (Local_Values::iterator
+             it = local_values.begin(),
+             end = local_values.end();
+         it != end;  ++it) {
+        it->second.stale = true;
+        it->second.savepoint = 0;
+    }
+    stale_count = local_values.size();
+
+    reads.clear();
+    read_cache.clear();
+    doomed_ = false;
+
+    discard_undo(0);
+    savepoint_ = last_savepoint_ = 0;
+}
+
+bool
+Sandbox::
+precheck(Epoch old_epoch) const
+{
+    // Some objects need to be in a critical section to look at their
+    // latest version
+    In_Out_Critical critical;
+
+    for (Local_Values::const_iterator
+             it = local_values.begin(),
+             end = local_values.end();
+         it != end;  ++it)
+        if (!it->second.stale
+            && !it->first->precheck(old_epoch, it->second.val))
+            return false;
+
+    return validate_reads(old_epoch);
+}
+
+bool
+Sandbox::
+validate_reads(Epoch old_epoch) const
+{
+    if (reads.empty()) return true;
+
+    // As for precheck(), some objects need to be in a critical section
+    // to look at their latest version.  The commit paths call us with
+    // only the object locks held, which don't protect that.
+    In_Out_Critical critical;
+
+    for (Reads::const_iterator it = reads.begin(), end = reads.end();
+         it != end;  ++it) {
+        // An object that can't say when it last changed might have
+        Epoch latest = it->first->latest_valid_from();
+        if (latest == 0 || latest > old_epoch)
+            return false;
+    }
+
+    return true;
+}
+
+bool
+Sandbox::
+read_earlier_in_group(const std::vector<Commit_Request *> & group,
+                      unsigned n) const
+{
+    if (reads.empty()) return false;
+
+    for (unsigned i = 0;  i < n;  ++i) {
+        if (!group[i]->result) continue;
+        const Local_Values & written = group[i]->sandbox->local_values;
+        for (Reads::const_iterator it = reads.begin(), end = reads.end();
+             it != end;  ++it)
+            if (written.find(it->first) != written.end())
+                return true;
+    }
+
+    return false;
+}
 
-    Local_Values::iterator
-        it = local_values.begin(),
-        end = local_values.end();
+Epoch
+Sandbox::
+commit_parallel(Epoch old_epoch)
+{
+    // Work out what to lock before taking the commit lock, so that a
+    // large commit holds it for no longer than it needs to.
+
+    // Lock the objects in address order so that two commits with
+    // overlapping sets of objects can't deadlock.
+    to_commit.assign(local_values.begin(), local_values.end());
+    std::sort(to_commit.begin(), to_commit.end(), Compare_Objects());
+
+    typedef To_Commit::iterator Iterator;
+
+    Iterator first = to_commit.begin(), last = to_commit.end();
+
+    // The objects that we read need to be locked too, so that nothing can
+    // change them between checking them and publishing our epoch.
+    to_lock.clear();
+    to_lock.reserve(to_commit.size() + reads.size());
+    for (Iterator it = first;  it != last;  ++it)
+        to_lock.push_back(it->first);
+
+    if (!reads.empty()) {
+        for (Reads::const_iterator it = reads.begin(), end = reads.end();
+             it != end;  ++it)
+            to_lock.push_back(it->first);
+        std::sort(to_lock.begin(), to_lock.end());
+        to_lock.erase(std::unique(to_lock.begin(), to_lock.end()),
+                      to_lock.end());
+    }
 
-    // Commit everything
-    for (; result && it != end;  ++it)
-        result = it->first->setup(old_epoch, new_epoch, it->second.val);
+    // Stop the epochs from being compressed underneath us.  Other commits
+    // can still go on at the same time.
+    ACE_Read_Guard<Commit_Lock> guard(commit_lock);
+
+    Object_Locks locks(to_lock);
+
+    if (doomed_ || !validate_reads(old_epoch))
+        return 0;
+
+    // Now that nothing else can commit to our objects, we can find out
+    // which epoch we will be.  If anything below throws, the objects
+    // already set up are rolled back and the epoch is released.
+    Reserved_Epoch reserved;
+    Epoch new_epoch = reserved.epoch;
+
+    bool result = setup_range(first, last, old_epoch, new_epoch);
 
     if (result) {
+        // Now that we know we will succeed, let anyone else writing our
+        // objects know that they won't.  This is done before the epoch is
+        // published so that nobody who could still succeed is doomed.
+        if (early_doom || priorities_in_use)
+            doom_other_writers();
+
         // First we update the epoch.  This ensures that any new snapshot
         // created will see the correct epoch value, and won't look at
         // old values which might not have a list.
@@ -66,30 +524,355 @@ commit(Epoch old_epoch)
         // could be created with the old epoch.  These transactions might
         // need the values being cleaned up, racing with the creation
         // process.
-        set_current_epoch(new_epoch);
+        reserved.publish();
 
         // Make sure these writes are seen before we clean up
         memory_barrier();
 
-        // Success: we are in a new epoch
-        for (it = local_values.begin(); it != end;  ++it)
-            it->first->commit(new_epoch);
-    }
-    else {
-        // Rollback any that were set up if there was a problem
-        for (end = boost::prior(it), it = local_values.begin();
-             it != end;  ++it)
-            it->first->rollback(new_epoch, it->second.val);
+        // Success: we are in a new epoch.  The old versions are
+        // registered for cleanup in one go before we unlock the objects.
+        Snapshot_Info::Cleanup_Batch cleanups;
+        commit_range(first, last, new_epoch);
     }
 
-    // TODO: for failed transactions, we'd do better to keep the
-    // structure to avoid reallocations
-    // TODO: clear as we go to better use cache
-    clear();
-        
     return (result ? new_epoch : 0);
 }
 
+
+/*****************************************************************************/
+/* GROUP COMMIT                                                              */
+/*****************************************************************************/
+
+/* In group commit mode, sandboxes that want to commit put themselves on a
+   queue.  Whichever thread finds that no group is being committed becomes
+   the leader: it takes everything on the queue, commits it all under a
+   single new epoch, and then wakes up the others with their results.
+   While it is doing so, the queue fills up again with the next group.
+
+   Within a group, the sandboxes are set up one after the other.  If two
+   sandboxes in the same group write the same object, the second one will
+   find that the object has already been updated for the new epoch and so
+   will fail just as it would have if the commits had been separate.
+   Objects whose writes don't conflict (counters, merges and
+   last-writer-wins objects) instead replace the new version in place, so
+   that there is still only one version per epoch to clean up.
+*/
+
+Commit_Mode commit_mode = PARALLEL_COMMIT;
+
+void set_commit_mode(Commit_Mode mode)
+{
+    commit_mode = mode;
+}
+
+Commit_Mode get_commit_mode()
+{
+    return commit_mode;
+}
+
+struct Compare_Priority {
+    bool operator () (const Sandbox::Commit_Request * r1,
+                      const Sandbox::Commit_Request * r2) const
+    {
+        return r1->sandbox->priority() > r2->sandbox->priority();
+    }
+};
+
+ACE_Thread_Mutex group_lock;
+ACE_Condition_Thread_Mutex group_finished(group_lock);
+
+/// Requests waiting for the next group to be committed
+std::vector<Sandbox::Commit_Request *> group_queue;
+
+/// Is there currently a leader committing a group?
+bool group_leader_active = false;
+
+Epoch
+Sandbox::
+commit_grouped(Epoch old_epoch)
+{
+    Commit_Request request(this, old_epoch);
+
+    ACE_Guard<ACE_Thread_Mutex> guard(group_lock);
+
+    group_queue.push_back(&request);
+
+    while (!request.done) {
+        if (group_leader_active) {
+            group_finished.wait();
+            continue;
+        }
+
+        // Nobody is committing; we lead the next group
+        group_leader_active = true;
+
+        std::vector<Commit_Request *> group;
+        group.swap(group_queue);
+
+        // Within a group, the first to be set up wins any conflicts
+        std::stable_sort(group.begin(), group.end(), Compare_Priority());
+
+        guard.release();
+
+        // Failures of single members are dealt with by install_group().
+        // Anything else fails the whole group, and every member that
+        // didn't get through is told what happened in its own thread.
+        bool threw = false;
+        std::string error;
+        try {
+            commit_group(group);
+        } catch (const std::exception & exc) {
+            threw = true;
+            error = exc.what();
+        } catch (...) {
+            threw = true;
+            error = "unknown exception committing group";
+        }
+
+        guard.acquire();
+
+        for (unsigned i = 0;  i < group.size();  ++i) {
+            if (threw && !group[i]->result && !group[i]->threw) {
+                group[i]->threw = true;
+                group[i]->error = error;
+            }
+            group[i]->done = true;
+        }
+
+        group_leader_active = false;
+        group_finished.broadcast();
+    }
+
+    request.rethrow();
+    return request.result;
+}
+
+void
+Sandbox::
+commit_group(const std::vector<Commit_Request *> & group)
+{
+    ACE_Write_Guard<Commit_Lock> guard(commit_lock);
+    install_group(group);
+}
+
+void
+Sandbox::
+install_group(const std::vector<Commit_Request *> & group)
+{
+    // Nothing else can be committing while the commit lock is held for
+    // writing, so there is no need for the object locks.
+    Reserved_Epoch reserved;
+    Epoch new_epoch = reserved.epoch;
+
+    bool any_succeeded = false;
+
+    for (unsigned i = 0;  i < group.size();  ++i) {
+        // A member whose setup throws has rolled itself back, and as it
+        // was the last to be set up nothing was replaced on top of it.
+        // Only it fails; the exception goes back to its own thread.
+        try {
+            // What the earlier members of the group set up isn't
+            // committed yet, so validate_reads() can't see it
+            if (group[i]->sandbox->doomed_
+                || !group[i]->sandbox->validate_reads(group[i]->old_epoch)
+                || group[i]->sandbox->read_earlier_in_group(group, i))
+                continue;
+
+            Local_Values & values = group[i]->sandbox->local_values;
+            if (setup_range(values.begin(), values.end(),
+                            group[i]->old_epoch, new_epoch)) {
+                group[i]->result = new_epoch;
+                any_succeeded = true;
+            }
+        } catch (const std::exception & exc) {
+            group[i]->threw = true;
+            group[i]->error = exc.what();
+        } catch (...) {
+            group[i]->threw = true;
+            group[i]->error = "unknown exception setting up commit";
+        }
+    }
+
+    if (!any_succeeded) return;
+
+    // Only now that nothing can fail are the other writers doomed
+    if (early_doom || priorities_in_use) {
+        for (unsigned j = 0;  j < group.size();  ++j)
+            if (group[j]->result)
+                group[j]->sandbox->doom_other_writers();
+    }
+
+    reserved.publish();
+
+    // Make sure these writes are seen before we clean up
+    memory_barrier();
+
+    Snapshot_Info::Cleanup_Batch cleanups;
+
+    for (unsigned i = 0;  i < group.size();  ++i) {
+        if (!group[i]->result) continue;
+        Local_Values & values = group[i]->sandbox->local_values;
+        commit_range(values.begin(), values.end(), new_epoch);
+    }
+}
+
+
+/*****************************************************************************/
+/* PRIORITIES                                                                */
+/*****************************************************************************/
+
+/* Once priorities or early doom are in use, every sandbox registers itself
+   as a writer of each object the first time it writes it, and removes
+   itself when it is cleared.  A committing sandbox looks up the other
+   writers of its objects to find out who to doom and who to give way to.
+
+   The registry is split into stripes by object address so that unrelated
+   writers don't contend on a single lock.  A sandbox can't go away while
+   it is still registered, so it's safe to look at one found in the
+   registry as long as the stripe is locked.
+*/
+
+volatile bool track_writers = false;
+
+struct Writer_Stripe {
+    Spinlock lock;
+
+    typedef std::vector<std::pair<const Versioned_Object *, Sandbox *> >
+        Writers;
+    Writers writers;
+};
+
+enum { NUM_WRITER_STRIPES = 64 };
+
+Writer_Stripe writer_stripes[NUM_WRITER_STRIPES];
+
+Writer_Stripe & get_writer_stripe(const Versioned_Object * obj)
+{
+    // Low bits are always zero due to alignment
+    return writer_stripes[((size_t)obj >> 4) % NUM_WRITER_STRIPES];
+}
+
+void
+Sandbox::
+set_priority(int priority)
+{
+    if (priority != 0 && !priorities_in_use) {
+        priorities_in_use = true;
+        track_writers = true;
+    }
+    priority_ = priority;
+}
+
+void enable_early_doom()
+{
+    early_doom = true;
+    track_writers = true;
+}
+
+void disable_early_doom()
+{
+    early_doom = false;
+    track_writers = priorities_in_use;
+}
+
+void disable_priorities()
+{
+    priorities_in_use = false;
+    track_writers = early_doom;
+}
+
+void
+Sandbox::
+register_writer(const Versioned_Object * obj)
+{
+    // Nobody can stop anyone else writing these, so no need to know
+    if (!obj->writes_conflict()) return;
+
+    Writer_Stripe & stripe = get_writer_stripe(obj);
+    ACE_Guard<Spinlock> guard(stripe.lock);
+    stripe.writers.push_back(std::make_pair(obj, this));
+    registered_ = true;
+}
+
+void
+Sandbox::
+unregister_writer(const Versioned_Object * obj)
+{
+    // Objects written before the registry was turned on won't be found,
+    // which is fine
+    Writer_Stripe & stripe = get_writer_stripe(obj);
+    ACE_Guard<Spinlock> guard(stripe.lock);
+
+    Writer_Stripe::Writers & writers = stripe.writers;
+    for (unsigned i = 0;  i < writers.size();  ++i) {
+        if (writers[i].first != obj || writers[i].second != this)
+            continue;
+        writers[i] = writers.back();
+        writers.pop_back();
+        break;
+    }
+}
+
+void
+Sandbox::
+unregister_writers()
+{
+    for (Local_Values::const_iterator
+             it = local_values.begin(),
+             end = local_values.end();
+         it != end;  ++it)
+        unregister_writer(it->first);
+
+    registered_ = false;
+}
+
+bool
+Sandbox::
+outranked() const
+{
+    for (Local_Values::const_iterator
+             it = local_values.begin(),
+             end = local_values.end();
+         it != end;  ++it) {
+        Writer_Stripe & stripe = get_writer_stripe(it->first);
+        ACE_Guard<Spinlock> guard(stripe.lock);
+
+        const Writer_Stripe::Writers & writers = stripe.writers;
+        for (unsigned i = 0;  i < writers.size();  ++i) {
+            if (writers[i].first != it->first || writers[i].second == this)
+                continue;
+            const Sandbox * other = writers[i].second;
+            if (other->immune_) return true;
+            if (!immune_ && other->priority_ > priority_) return true;
+        }
+    }
+
+    return false;
+}
+
+void
+Sandbox::
+doom_other_writers() const
+{
+    for (Local_Values::const_iterator
+             it = local_values.begin(),
+             end = local_values.end();
+         it != end;  ++it) {
+        Writer_Stripe & stripe = get_writer_stripe(it->first);
+        ACE_Guard<Spinlock> guard(stripe.lock);
+
+        const Writer_Stripe::Writers & writers = stripe.writers;
+        for (unsigned i = 0;  i < writers.size();  ++i) {
+            if (writers[i].first != it->first || writers[i].second == this)
+                continue;
+            Sandbox * other = writers[i].second;
+            if (other->immune_) continue;
+            if (early_doom || immune_ || other->priority_ < priority_)
+                other->doom();
+        }
+    }
+}
+
 void
 Sandbox::
 dump(std::ostream & stream, int indent) const
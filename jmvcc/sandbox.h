@@ -9,14 +9,51 @@
 #define __jmvcc__sandbox_h__
 
 
-#include "jml/utils/lightweight_hash.h"
 #include "jml/utils/string_functions.h"
+#include "jml/arch/exception.h"
 #include "versioned_object.h"
+#include "small_map.h"
+#include "arena.h"
 #include <boost/tuple/tuple.hpp>
+#include <vector>
 
 namespace JMVCC {
 
 
+/// How sandboxes are committed
+enum Commit_Mode {
+    PARALLEL_COMMIT,   ///< Each commit locks its own objects; disjoint
+                       ///< commits run at the same time
+    GROUP_COMMIT       ///< Waiting commits are gathered up and committed
+                       ///< together under a single epoch by one thread
+};
+
+void set_commit_mode(Commit_Mode mode);
+Commit_Mode get_commit_mode();
+
+/** Turn on early doom: when a commit installs a new value of an object,
+    any other in-flight sandbox that has written that object is certain to
+    fail, and so is marked as doomed straight away.  Long running
+    transactions can then poll doomed() and give up rather than finishing
+    work that will be thrown away. */
+void enable_early_doom();
+
+/** Turn early doom off again.  Should only be called when no sandbox is
+    committing; those already registered as writers stay so until they
+    are cleared. */
+void disable_early_doom();
+
+/** Go back to ignoring priorities, as before any sandbox was given one,
+    until set_priority() is next called with a non-zero priority.  Should
+    only be called when no sandbox is committing. */
+void disable_priorities();
+
+/// Set once anything needs to know who is writing what (a sandbox has been
+/// given a priority, or early doom is on).  Until then, writes aren't
+/// tracked.
+extern volatile bool track_writers;
+
+
 /*****************************************************************************/
 /* SANDBOX                                                                   */
 /*****************************************************************************/
@@ -26,35 +63,141 @@ namespace JMVCC {
 
 class Sandbox {
     struct Entry {
-        Entry() : val(0), size(0)
+        Entry() : val(0), destroy(0), savepoint(0), stale(false)
         {
         }
 
         void * val;
-        size_t size;
+        void (*destroy)(void * val);  ///< Runs the destructor of val
+        unsigned savepoint;  ///< Newest savepoint that can restore us
+        bool stale;          ///< Left over from a failed commit
 
         std::string print() const
         {
-            return ML::format("val: %p size: %zd", val, size);
+            return ML::format("val: %p", val);
         }
     };
 
-    typedef ML::Lightweight_Hash<Versioned_Object *, Entry> Local_Values;
+    /// Most transactions write only a handful of objects, which are kept
+    /// inside the sandbox and found by scanning
+    typedef Small_Map<Versioned_Object *, Entry> Local_Values;
     Local_Values local_values;
 
+    /// Where the local values live.  It is reset rather than each value
+    /// being freed when the sandbox is cleared.
+    Arena arena;
+
+    /// Objects read (but not necessarily written) by the transaction, each
+    /// once however often it was read.  Only kept when the sandbox is
+    /// serializable.
+    typedef Small_Map<Versioned_Object *, bool> Reads;
+    Reads reads;
+
+    /// Scratch space for commit_parallel(), kept here so that a retry
+    /// doesn't need to allocate it again
+    typedef std::vector<std::pair<Versioned_Object *, Entry> > To_Commit;
+    To_Commit to_commit;
+    std::vector<Versioned_Object *> to_lock;
+
+    bool serializable;
+
+    int priority_;
+
+    /// Set by a higher priority commit that conflicts with us
+    volatile bool doomed_;
+
+    /// Other commits can't doom us or make us give way
+    bool immune_;
+
+    /// Are we (possibly) in the registry of in-flight writers?
+    bool registered_;
+
+    void register_writer(const Versioned_Object * obj);
+    void unregister_writer(const Versioned_Object * obj);
+    void unregister_writers();
+
+    /// How to put back a local value the way it was when a savepoint was
+    /// taken.  A null old_val means that there was no local value.
+    struct Undo_Entry {
+        Versioned_Object * obj;
+        void * old_val;
+        unsigned savepoint;
+        void (*destroy)(void * val);
+    };
+
+    typedef std::vector<Undo_Entry> Undo_Log;
+    Undo_Log undo_log;
+
+    unsigned savepoint_;       ///< Innermost savepoint; 0 if there are none
+    unsigned last_savepoint_;  ///< Last savepoint number handed out
+
+    template<typename T>
+    static void destroy_value(void * val)
+    {
+        reinterpret_cast<T *>(val)->~T();
+    }
+
+    /// Record what the local value was before it's changed under a savepoint
+    template<typename T>
+    void save_value(Versioned_Object * obj, Entry & entry, bool inserted)
+    {
+        Undo_Entry undo;
+        undo.obj = obj;
+        undo.old_val = 0;
+        undo.savepoint = entry.savepoint;
+        undo.destroy = &destroy_value<T>;
+
+        if (!inserted) {
+            undo.old_val = arena.allocate<T>();
+            new (undo.old_val) T(*reinterpret_cast<T *>(entry.val));
+        }
+
+        undo_log.push_back(undo);
+        entry.savepoint = savepoint_;
+    }
+
+    void discard_undo(size_t new_size);
+
+    /// Number of local values that are stale
+    size_t stale_count;
+
+    bool reuse_on_retry_;
+
+    /// Versions already read from the snapshot, when caching reads
+    typedef Small_Map<const Versioned_Object *, const void *> Read_Cache;
+    Read_Cache read_cache;
+    Epoch read_cache_epoch_;   ///< Epoch that the cached versions are for
+    bool cache_reads_;
+
+    /// Clean up after a commit that failed
+    void failed();
+
+    /// Remove the local values that are stale or were rolled back
+    void compact();
+
 public:
+    Sandbox();
+
     ~Sandbox();
 
     void clear();
 
+    /** Return the local value for modification, or zero if there isn't
+        one. */
     template<typename T>
     T * local_value(Versioned_Object * obj)
     {
-        Local_Values::const_iterator it = local_values.find(obj);
-        if (it == local_values.end()) return 0;
+        // Most transactions never write anything; don't bother looking
+        if (local_values.empty()) return 0;
+        Local_Values::iterator it = local_values.find(obj);
+        if (it == local_values.end() || it->second.stale) return 0;
+        if (JML_UNLIKELY(savepoint_ > it->second.savepoint))
+            save_value<T>(obj, it->second, false /* inserted */);
         return reinterpret_cast<T *>(it->second.val);
     }
 
+    /** Return the local value for modification, creating it as a copy
+        of initial_value if there isn't one. */
     template<typename T>
     T * local_value(Versioned_Object * obj, const T & initial_value)
     {
@@ -62,18 +205,37 @@ public:
         Local_Values::iterator it;
         boost::tie(it, inserted)
             = local_values.insert(std::make_pair(obj, Entry()));
+        Entry & entry = it->second;
         if (inserted) {
-            it->second.val = malloc(sizeof(T));
-            new (it->second.val) T(initial_value);
-            it->second.size = sizeof(T);
+            T * val = arena.allocate<T>();
+            new (val) T(initial_value);
+            entry.val = val;
+            entry.destroy = &destroy_value<T>;
         }
-        return reinterpret_cast<T *>(it->second.val);
+        else if (JML_UNLIKELY(entry.stale)) {
+            // Left over from a failed attempt; reuse the memory
+            *reinterpret_cast<T *>(entry.val) = initial_value;
+            entry.stale = false;
+            --stale_count;
+            inserted = true;
+        }
+        if (inserted && JML_UNLIKELY(track_writers))
+            register_writer(obj);
+        if (JML_UNLIKELY(savepoint_ > entry.savepoint))
+            save_value<T>(obj, entry, inserted);
+        return reinterpret_cast<T *>(entry.val);
     }
     
+    /** Return the local value for reading only, or zero if there isn't
+        one. */
     template<typename T>
     const T * local_value(const Versioned_Object * obj)
     {
-        return local_value<T>(const_cast<Versioned_Object *>(obj));
+        if (local_values.empty()) return 0;
+        Local_Values::const_iterator it
+            = local_values.find(const_cast<Versioned_Object *>(obj));
+        if (it == local_values.end() || it->second.stale) return 0;
+        return reinterpret_cast<const T *>(it->second.val);
     }
 
     template<typename T>
@@ -82,15 +244,183 @@ public:
         return local_value(const_cast<Versioned_Object *>(obj), initial_value);
     }
 
+    /// Marks a point that the local values can be rolled back to
+    struct Savepoint {
+        Savepoint() : number(0), previous(0), undo_size(0)
+        {
+        }
+
+        unsigned number;
+        unsigned previous;
+        size_t undo_size;
+    };
+
+    /** Take a savepoint.  Any changes to the local values made after this
+        can be undone with rollback_to() without losing the ones made
+        before.  Savepoints nest, and must be rolled back or released in
+        the reverse of the order that they were taken. */
+    Savepoint savepoint();
+
+    /// Undo everything since the savepoint was taken, and end it
+    void rollback_to(const Savepoint & savepoint);
+
+    /// End the savepoint, keeping the changes made since it was taken
+    void release(const Savepoint & savepoint);
+
+    /** When a commit fails, keep the local values and their memory rather
+        than throwing them away.  They are marked as stale, so that they
+        are invisible, and each one is reused the next time the same
+        object is written.  Any that aren't written again are dropped at
+        the next commit.  This saves reallocating everything when a
+        transaction is retried. */
+    void set_reuse_on_retry(bool reuse)
+    {
+        reuse_on_retry_ = reuse;
+    }
+
+    bool reuse_on_retry() const { return reuse_on_retry_; }
+
+    /** Remember where the version of each object read from the snapshot
+        is, so that reading it again doesn't have to look for it.  Worth
+        turning on for transactions that read the same objects many
+        times. */
+    void set_cache_reads(bool cache)
+    {
+        cache_reads_ = cache;
+        read_cache.clear();
+    }
+
+    bool cache_reads() const { return cache_reads_; }
+
+    /** Return the version of the object in the snapshot at the given
+        epoch recorded by cache_read(), or zero if there isn't one. */
+    template<typename T>
+    const T * cached_read(const Versioned_Object * obj, Epoch epoch) const
+    {
+        if (read_cache_epoch_ != epoch) return 0;
+        Read_Cache::const_iterator it = read_cache.find(obj);
+        if (it == read_cache.end()) return 0;
+        return reinterpret_cast<const T *>(it->second);
+    }
+
+    /** Record where the version of the object in the snapshot at the
+        given epoch is.  It must stay there for as long as a snapshot is
+        registered at that epoch. */
+    void cache_read(const Versioned_Object * obj, Epoch epoch,
+                    const void * val)
+    {
+        if (read_cache_epoch_ != epoch) {
+            read_cache.clear();
+            read_cache_epoch_ = epoch;
+        }
+        read_cache.insert(std::make_pair(obj, val));
+    }
+
+    /** Make the sandbox serializable.  As well as the usual write-write
+        conflicts, a commit will then fail if anything that was read has
+        been changed by another commit since the snapshot was taken, which
+        stops write skew.  Costs nothing when not turned on. */
+    void set_serializable(bool serializable)
+    {
+        this->serializable = serializable;
+    }
+
+    bool is_serializable() const { return serializable; }
+
+    /// Note that the given object was read from the snapshot
+    void record_read(const Versioned_Object * obj)
+    {
+        if (JML_UNLIKELY(serializable))
+            reads.insert(std::make_pair(const_cast<Versioned_Object *>(obj),
+                                        true));
+    }
+
+    /** Set the priority of the sandbox.  When we commit, any in-flight
+        sandbox with a lower priority that has written one of our objects is
+        doomed once our new values are set up, and we will fail rather than
+        commit over the top of a writer with a higher priority.  The
+        default is zero. */
+    void set_priority(int priority);
+
+    int priority() const { return priority_; }
+
+    /** Has a higher priority commit, or (with early doom) a commit that
+        conflicts with us, doomed us?  If so, the commit will fail, and so
+        there is no point in doing any more work. */
+    bool doomed() const { return doomed_; }
+
+    void doom() { doomed_ = true; }
+
+    /** Make the sandbox immune to other commits: none of them will doom
+        it, and it wins against a writer of any priority.  Used while the
+        commit lock is held for writing, so that nothing else can make the
+        commit fail. */
+    void set_immune(bool immune) { immune_ = immune; }
+
+    bool immune() const { return immune_; }
+
     /** Commits the current transaction.  Returns zero if the transaction
-        failed, or returns the id of the new epoch if it succeeded. */
+        failed, or returns the id of the new epoch if it succeeded.  A
+        sandbox with nothing in it always succeeds, and returns old_epoch
+        without creating a new one. */
     Epoch commit(Epoch old_epoch);
 
+    /** Same as commit(), but for when the caller already holds the
+        commit lock for writing (so that nothing else can be committing). */
+    Epoch commit_locked(Epoch old_epoch);
+
+    /** Check, without taking any locks, whether the sandbox could still
+        be committed on top of the given epoch.  A false return means that
+        a commit is certain to fail; true means that it might succeed. */
+    bool precheck(Epoch old_epoch) const;
+
+    struct Commit_Request;
+
     void dump(std::ostream & stream = std::cerr, int indent = 0) const;
 
-    size_t num_local_values() const { return local_values.size(); }
+    size_t num_local_values() const
+    {
+        return local_values.size() - stale_count;
+    }
+
+    /// Number of different objects read, when serializable
+    size_t num_reads() const { return reads.size(); }
 
     friend std::ostream & operator << (std::ostream&, const Sandbox::Entry&);
+
+private:
+    Epoch do_commit(Epoch old_epoch, bool lock_held);
+
+    /// Check that nothing we read has changed since the given epoch.
+    /// Enters a critical section of its own, so it can be called from
+    /// anywhere.
+    bool validate_reads(Epoch old_epoch) const;
+
+    /// Did one of the first n members of the group, which have already
+    /// been set up, write something that we read?
+    bool read_earlier_in_group(const std::vector<Commit_Request *> & group,
+                               unsigned n) const;
+
+    /// Is there a higher priority (or immune) writer of one of our
+    /// objects?  If so we should give way to it and fail.
+    bool outranked() const;
+
+    /// Doom the other writers of our objects, as we are about to commit
+    /// over the top of them: all of them with early doom, otherwise only
+    /// those with a lower priority.  Only called once our setup succeeded.
+    void doom_other_writers() const;
+
+    /// Commit on our own, locking only the objects that we write
+    Epoch commit_parallel(Epoch old_epoch);
+
+    /// Wait for our commit to be done as part of a group
+    Epoch commit_grouped(Epoch old_epoch);
+
+    /// Commit a whole group of sandboxes under a single new epoch
+    static void commit_group(const std::vector<Commit_Request *> & group);
+
+    /// Same, but with the commit lock already held for writing
+    static void install_group(const std::vector<Commit_Request *> & group);
 };
 
 std::ostream &
@@ -0,0 +1,125 @@
+/* small_map.h                                                     -*- C++ -*-
+   Jeremy Barnes, 22 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Map optimized for holding only a few entries.
+*/
+
+#ifndef __jmvcc__small_map_h__
+#define __jmvcc__small_map_h__
+
+#include "jml/utils/lightweight_hash.h"
+#include <boost/utility.hpp>
+#include <utility>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* SMALL_MAP                                                                 */
+/*****************************************************************************/
+
+/** A map whose entries are kept in an array in insertion order.  The first
+    INLINE entries are stored inside the map itself, so that a small map
+    never allocates memory.  Up to LINEAR entries are found by scanning;
+    beyond that, a hash index is built.
+
+    Both the key and the value need to be cheap to copy, as they are moved
+    around by assignment when the array grows.  Iterators are pointers into
+    the array and so are invalidated by an insert().  clear() keeps any
+    memory that was allocated, ready to be used again.
+*/
+
+template<typename Key, typename Value, int INLINE = 4, int LINEAR = 8>
+struct Small_Map : boost::noncopyable {
+    typedef std::pair<Key, Value> value_type;
+    typedef value_type * iterator;
+    typedef const value_type * const_iterator;
+
+    Small_Map()
+        : vals(inline_vals), size_(0), capacity_(INLINE)
+    {
+    }
+
+    ~Small_Map()
+    {
+        if (vals != inline_vals) delete[] vals;
+    }
+
+    iterator begin() { return vals; }
+    iterator end() { return vals + size_; }
+    const_iterator begin() const { return vals; }
+    const_iterator end() const { return vals + size_; }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    iterator find(const Key & key)
+    {
+        if (size_ <= LINEAR) {
+            for (unsigned i = 0;  i < size_;  ++i)
+                if (vals[i].first == key) return vals + i;
+            return end();
+        }
+
+        typename Index::const_iterator it = index.find(key);
+        if (it == index.end()) return end();
+        return vals + it->second;
+    }
+
+    const_iterator find(const Key & key) const
+    {
+        return const_cast<Small_Map *>(this)->find(key);
+    }
+
+    std::pair<iterator, bool> insert(const value_type & val)
+    {
+        iterator it = find(val.first);
+        if (it != end()) return std::make_pair(it, false);
+
+        if (size_ == capacity_) grow();
+
+        // Once we're past the size where scanning is quick, keep an index
+        if (size_ >= LINEAR) {
+            if (size_ == LINEAR)
+                for (unsigned i = 0;  i < size_;  ++i)
+                    index.insert(std::make_pair(vals[i].first, i));
+            index.insert(std::make_pair(val.first, size_));
+        }
+
+        vals[size_] = val;
+        ++size_;
+
+        return std::make_pair(vals + size_ - 1, true);
+    }
+
+    void clear()
+    {
+        if (size_ > LINEAR) index.clear();
+        size_ = 0;
+    }
+
+private:
+    value_type inline_vals[INLINE];
+    value_type * vals;
+    unsigned size_;
+    unsigned capacity_;
+
+    typedef ML::Lightweight_Hash<Key, unsigned> Index;
+    Index index;
+
+    void grow()
+    {
+        unsigned new_capacity = capacity_ * 2;
+        value_type * new_vals = new value_type[new_capacity];
+        std::copy(vals, vals + size_, new_vals);
+        if (vals != inline_vals) delete[] vals;
+        vals = new_vals;
+        capacity_ = new_capacity;
+    }
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__small_map_h__ */
@@ -7,6 +7,8 @@
 #include "transaction.h"
 #include "jml/utils/pair_utils.h"
 #include "jml/arch/atomic_ops.h"
+#include <algorithm>
+#include <pthread.h>
 
 
 using namespace std;
@@ -16,10 +18,78 @@ namespace JMVCC {
 
 volatile Epoch current_epoch_ = 1;
 Epoch earliest_epoch_ = 1;
+volatile unsigned epoch_compressions = 0;
 
 Snapshot_Info snapshot_info;
 
 
+/*****************************************************************************/
+/* EPOCH CLOCK                                                               */
+/*****************************************************************************/
+
+/* Commits to disjoint sets of objects can run at the same time, but the
+   epochs that they create still need to become visible one at a time and in
+   order: a snapshot taken at epoch n must see every commit up to n and none
+   after it.  Each commit reserves its epoch number once it holds all of its
+   object locks, and publishes it once its new versions are in place.  The
+   publication waits for the previous epoch, which can't deadlock as the
+   commit holding it already has all of the locks that it needs.
+
+   The number of commits in flight is tracked so that when there are none,
+   the next epoch is always based on current_epoch_.  This keeps things
+   working when the current epoch is moved back by compress_epochs() or
+   by the testing code.
+*/
+
+Spinlock epoch_lock;
+Epoch last_reserved_epoch = 0;
+int epochs_in_flight = 0;
+
+void wait_for_epoch(Epoch epoch)
+{
+    for (int tries = 0;  get_current_epoch() != epoch;  ++tries) {
+        if (tries == 100) {
+            tries = 0;
+            sched_yield();
+        }
+    }
+}
+
+Epoch reserve_epoch()
+{
+    ACE_Guard<Spinlock> guard(epoch_lock);
+    Epoch base = (epochs_in_flight ? last_reserved_epoch : get_current_epoch());
+    ++epochs_in_flight;
+    return last_reserved_epoch = base + 1;
+}
+
+void publish_epoch(Epoch epoch)
+{
+    wait_for_epoch(epoch - 1);
+
+    ACE_Guard<Spinlock> guard(epoch_lock);
+    set_current_epoch(epoch);
+    --epochs_in_flight;
+}
+
+void release_epoch(Epoch epoch)
+{
+    {
+        ACE_Guard<Spinlock> guard(epoch_lock);
+        if (last_reserved_epoch == epoch) {
+            // Nobody is after us; simply hand it back
+            --last_reserved_epoch;
+            --epochs_in_flight;
+            return;
+        }
+    }
+
+    // Someone reserved an epoch after ours and will be waiting for it, so
+    // we publish an empty one.
+    publish_epoch(epoch);
+}
+
+
 /*****************************************************************************/
 /* SNAPSHOT_INFO                                                             */
 /*****************************************************************************/
@@ -154,49 +224,173 @@ Snapshot_Info snapshot_info;
       v900
 */
 
+Snapshot_Info::
+Snapshot_Info()
+    : newest_entry(0), use_slots(false), num_retired(0)
+{
+}
+
+Snapshot_Info::
+~Snapshot_Info()
+{
+    for (unsigned i = 0;  i < entries.size();  ++i)
+        delete entries[i];
+    for (unsigned i = 0;  i < spare_entries.size();  ++i)
+        delete spare_entries[i];
+}
+
 Epoch
 Snapshot_Info::
-register_snapshot(Snapshot * snapshot)
+register_snapshot(Snapshot * snapshot, Epoch max_staleness)
 {
-    ACE_Guard<Mutex> guard(lock);
-    snapshot->epoch_ = get_current_epoch();
+    if (use_slots) return register_slot_snapshot(snapshot, max_staleness);
 
-    // TODO: since we know it will be inserted at the end, we can do a more
-    // efficient lookup that only looks at the end.
+    // Usually there is already a snapshot at the current epoch (or one
+    // that is recent enough), and we can simply join it
+    Entry * newest = newest_entry;
+    if (newest && newest->join(snapshot, max_staleness))
+        return snapshot->epoch_;
 
-    Entries::iterator previous_most_recent;
-    if (entries.empty()) previous_most_recent = entries.end();
-    else previous_most_recent = boost::prior(entries.end());
+    ACE_Guard<Mutex> guard(lock);
+    snapshot->epoch_ = get_current_epoch();
 
-    entries[snapshot->epoch_].snapshots.insert(snapshot);
+    Entry * previous_most_recent = (entries.empty() ? 0 : entries.back());
 
     /* INVARIANT: a registered snapshot should always go at the end of the
        list of snapshots; it is new and should therefore always be the last
        one.  We check it here. */
-    Entries::iterator it = entries.find(snapshot->epoch_);
-    if (it == entries.end())
-        throw Exception("inserted but not found");
-    if (it != boost::prior(entries.end())) {
+    Entry * entry = previous_most_recent;
+    if (!entry || entry->epoch < snapshot->epoch_) {
+        entry = new_entry(snapshot->epoch_);
+        entries.push_back(entry);
+        newest_entry = entry;
+    }
+    else if (entry->epoch > snapshot->epoch_) {
         cerr << "stale snapshot" << endl;
         dump_unlocked();
         cerr << "snapshot->epoch_ = " << snapshot->epoch_ << endl;
         throw Exception("inserted stale snapshot");
     }
 
+    entry->add_snapshot(snapshot);
+
     /* Since we don't clean up anything based upon the most recent snapshot,
        we now need to look at what was the most recent snapshot and see if
        it needs to be cleaned up. */
-    if (previous_most_recent != it && previous_most_recent != entries.end()) {
+    if (previous_most_recent && previous_most_recent != entry) {
         /* Do we need to clean it up? */
         // NOTE: calling this function RELEASES the lock; we can't tough
         // entries after.
-        if (previous_most_recent->second.snapshots.empty())
-            perform_cleanup(previous_most_recent, guard);
+        if (previous_most_recent->num_snapshots == 0)
+            perform_cleanup(boost::prior(entries.end(), 2), guard);
     }
 
     return snapshot->epoch_;
 }
 
+Snapshot_Info::Entry *
+Snapshot_Info::
+new_entry(Epoch epoch)
+{
+    Entry * result;
+    if (spare_entries.empty()) result = new Entry();
+    else {
+        result = spare_entries.back();
+        spare_entries.pop_back();
+    }
+
+    result->epoch = epoch;
+    return result;
+}
+
+Snapshot_Info::Entries::iterator
+Snapshot_Info::
+find_entry(const Entry * entry)
+{
+    // Most of the time it's at one end or the other
+    if (entries.front() == entry) return entries.begin();
+    if (entries.back() == entry) return boost::prior(entries.end());
+
+    // They are in order of epoch, so we can do a binary search
+    Entries::iterator first = entries.begin(), last = entries.end();
+    while (first != last) {
+        Entries::iterator mid = first + (last - first) / 2;
+        if ((*mid)->epoch < entry->epoch) first = mid + 1;
+        else last = mid;
+    }
+
+    if (first == entries.end() || *first != entry)
+        throw Exception("snapshot entry not found");
+
+    return first;
+}
+
+void Snapshot_Info::Entry::
+add_snapshot(Snapshot * snapshot)
+{
+    ACE_Guard<Spinlock> guard(lock);
+    link(snapshot);
+}
+
+int Snapshot_Info::Entry::
+remove_snapshot(Snapshot * snapshot)
+{
+    ACE_Guard<Spinlock> guard(lock);
+    unlink(snapshot);
+    return num_snapshots;
+}
+
+bool Snapshot_Info::Entry::
+join(Snapshot * snapshot, Epoch max_staleness)
+{
+    ACE_Guard<Spinlock> guard(lock);
+
+    // An entry with no snapshots is being retired (or has been, and is
+    // waiting to be reused).  Only the newest entry can be for the
+    // current epoch.  While we have snapshots, whatever they can see is
+    // kept, so any live entry that is recent enough will do.
+    if (num_snapshots == 0 || epoch + max_staleness < get_current_epoch())
+        return false;
+
+    snapshot->epoch_ = epoch;
+    link(snapshot);
+    return true;
+}
+
+bool Snapshot_Info::Entry::
+leave(Snapshot * snapshot)
+{
+    ACE_Guard<Spinlock> guard(lock);
+
+    // The last one out needs to clean up, which needs the registry lock
+    if (num_snapshots <= 1) return false;
+
+    unlink(snapshot);
+    return true;
+}
+
+void Snapshot_Info::Entry::
+link(Snapshot * snapshot)
+{
+    snapshot->entry_ = this;
+    snapshot->prev_ = 0;
+    snapshot->next_ = snapshots;
+    if (snapshots) snapshots->prev_ = snapshot;
+    snapshots = snapshot;
+    ++num_snapshots;
+}
+
+void Snapshot_Info::Entry::
+unlink(Snapshot * snapshot)
+{
+    if (snapshot->prev_) snapshot->prev_->next_ = snapshot->next_;
+    else snapshots = snapshot->next_;
+    if (snapshot->next_) snapshot->next_->prev_ = snapshot->prev_;
+    snapshot->entry_ = 0;
+    snapshot->prev_ = snapshot->next_ = 0;
+    --num_snapshots;
+}
+
 void Snapshot_Info::Entry::
 add_cleanup(const Cleanup_Entry & cleanup)
 {
@@ -204,12 +398,31 @@ add_cleanup(const Cleanup_Entry & cleanup)
     cleanups.push_back(cleanup);
 }
 
+template<class Iterator>
+void Snapshot_Info::Entry::
+add_cleanups(Iterator first, Iterator last)
+{
+    ACE_Guard<Spinlock> guard(lock);
+    for (; first != last;  ++first)
+        cleanups.push_back(Cleanup_Entry(first->first, first->second));
+}
+
 void
 Snapshot_Info::
 remove_snapshot(Snapshot * snapshot)
 {
     snapshot->status = RESTARTING0;
 
+    if (use_slots) {
+        remove_slot_snapshot(snapshot);
+        return;
+    }
+
+    // If others are still at our epoch, there is nothing to clean up
+    Entry * current_entry = snapshot->entry_;
+    if (current_entry && current_entry->leave(snapshot))
+        return;
+
     ACE_Guard<Mutex> guard(lock);
 
     if (entries.empty())
@@ -217,8 +430,8 @@ remove_snapshot(Snapshot * snapshot)
     
     snapshot->status = RESTARTING0A;
     
-    Entries::iterator it = entries.find(snapshot->epoch());
-    if (it == entries.end()) {
+    Entry * entry = snapshot->entry_;
+    if (!entry) {
         cerr << "-------- snapshot not found -----------" << endl;
         cerr << "snapshot = " << snapshot << endl;
         cerr << "current_trans = " << current_trans << endl;
@@ -231,16 +444,9 @@ remove_snapshot(Snapshot * snapshot)
             throw Exception("snapshot not found");
     }
     
-    /* Is this the most recent snapshot?  If so, we can't clean up,
-       even if we're removing the last entry, as there might be a
-       new snapshot created with the same epoch. */
-    //bool most_recent = (it == boost::prior(entries.end()));
-    
-    Entry & entry = it->second;
-    
-    if (!entry.snapshots.count(snapshot)) {
+    if (entry->epoch != snapshot->epoch()) {
         cerr << "-------- snapshot out of sync -----------" << endl;
-        snapshot_info.dump();
+        snapshot_info.dump_unlocked();
         //snapshot->dump();
         if (current_trans)
             current_trans->dump();
@@ -249,13 +455,10 @@ remove_snapshot(Snapshot * snapshot)
         throw Exception("snapshots out of sync");
     }
     
-    
-    entry.snapshots.erase(snapshot);
-    
     // NOTE: this must be last in the function; it causes the guard to be
-    // released
-    if (entry.snapshots.empty() /* && !most_recent*/)
-        perform_cleanup(it, guard);
+    // released.  Once there are none left, nobody else can join.
+    if (entry->remove_snapshot(snapshot) == 0)
+        perform_cleanup(find_entry(entry), guard);
 }
 
 void
@@ -265,12 +468,10 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
     // TODO: try to hold the lock for less time here.  We only really need
     // the lock to add things to the previous snapshot.
     
-    if (!it->second.snapshots.empty())
+    Entry & entry = **it;
+
+    if (entry.num_snapshots != 0)
         throw Exception("perform_cleanup with snapshots");
-    //if (it == boost::prior(entries.end()) && it->first == get_current_epoch())
-    //    throw Exception("cleaning up most recent entry");
-    if (it == entries.end())
-        throw Exception("cleaning up invalid entry");
 
     /* Find where the previous snapshot is; any that can't be deleted
        here (due to being needed by a later snapshot) will need to be
@@ -281,10 +482,8 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
     Entries::iterator itnext = boost::next(it);
 
     if (it != entries.begin()) {
-        Entries::iterator jt = boost::prior(it);
-        
-        prev_snapshot = &jt->second;
-        prev_epoch = jt->first;
+        prev_snapshot = *boost::prior(it);
+        prev_epoch = prev_snapshot->epoch;
     }
     else {
         // Earliest epoch has changed, as this is the earliest known
@@ -292,14 +491,14 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
         try {
             if (itnext == entries.end())
                 set_earliest_epoch(get_current_epoch());
-            else set_earliest_epoch(itnext->first);
+            else set_earliest_epoch((*itnext)->epoch);
         } catch (const std::exception & exc) {
             cerr << "exception setting earliest epoch" << endl;
             dump_unlocked();
             cerr << "itnext == entries.end() = "
                  << (itnext == entries.end()) << endl;
             if (itnext != entries.end())
-                cerr << "itnext->first = " << itnext->first
+                cerr << "itnext->epoch = " << (*itnext)->epoch
                      << endl;
             throw;
         }
@@ -310,8 +509,6 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
     
     int num_to_cleanup = 0;
     
-    Entry & entry = it->second;
-
     // List of things to clean up once we release the guard
     vector<Cleanup_Entry> to_clean_up;
     
@@ -336,9 +533,11 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
     
     to_clean_up.swap(entry.cleanups);
 
-    Epoch snapshot_epoch = it->first;
+    Epoch snapshot_epoch = entry.epoch;
 
     entries.erase(it);
+    spare_entries.push_back(&entry);
+    newest_entry = (entries.empty() ? 0 : entries.back());
 
     // Release the guard so that we can lock the objects
     guard.release();
@@ -363,35 +562,356 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
     }
 }
 
+/// Batch of cleanups being held back for the current thread, if any
+__thread Snapshot_Info::Cleanup_Batch * current_cleanup_batch = 0;
+
+Snapshot_Info::Cleanup_Batch::
+Cleanup_Batch()
+    : active(!current_cleanup_batch)
+{
+    if (active) current_cleanup_batch = this;
+}
+
+Snapshot_Info::Cleanup_Batch::
+~Cleanup_Batch()
+{
+    if (!active) return;
+    current_cleanup_batch = 0;
+    if (!cleanups.empty())
+        snapshot_info.register_cleanups(*this);
+}
+
 void
 Snapshot_Info::
 register_cleanup(Versioned_Object * obj, Epoch valid_from_to_cleanup)
 {
-    // This is always called with the commit lock held, so:
-    // 1.  The cleanups cannot happen at the same time;
-    // 2.  There is only one thing here at a given time
+    // This is always called with the object's commit lock held, so there
+    // can only be one commit registering a cleanup for a given object at
+    // a given time.  A batch has to be registered before the commit locks
+    // are released for the same reason.
+
+    if (current_cleanup_batch) {
+        current_cleanup_batch->cleanups
+            .push_back(make_pair(obj, valid_from_to_cleanup));
+        return;
+    }
+
+    if (use_slots) {
+        retire(obj, valid_from_to_cleanup);
+        return;
+    }
     
     // NOTE: this is called with the object's lock held
-    Entries::iterator it;
-
     {
         ACE_Guard<Mutex> guard(lock);
 
         if (entries.empty())
             throw Exception("register_cleanup with no snapshots");
 
-        it = boost::prior(entries.end());
-        it->second.add_cleanup(Cleanup_Entry(obj, valid_from_to_cleanup));
+        entries.back()->add_cleanup(Cleanup_Entry(obj, valid_from_to_cleanup));
     }
 }
 
+void
+Snapshot_Info::
+register_cleanups(const Cleanup_Batch & batch)
+{
+    if (use_slots) {
+        for (unsigned i = 0;  i < batch.cleanups.size();  ++i)
+            retire(batch.cleanups[i].first, batch.cleanups[i].second);
+        return;
+    }
+
+    ACE_Guard<Mutex> guard(lock);
+
+    if (entries.empty())
+        throw Exception("register_cleanups with no snapshots");
+
+    entries.back()->add_cleanups(batch.cleanups.begin(), batch.cleanups.end());
+}
+
+
+/*****************************************************************************/
+/* SNAPSHOT SLOTS                                                            */
+/*****************************************************************************/
+
+/* In slot mode, each thread that takes snapshots claims a slot, and keeps
+   the oldest epoch of its snapshots there (zero when it has none).  The
+   slots are padded out to a cache line each so that threads don't
+   contend on them.
+
+   When a commit replaces a version, the version is retired along with the
+   current epoch.  Every snapshot that could see it is older than that, so
+   once the oldest epoch in the slots has caught up to it, it can be
+   cleaned up.
+
+   A thread that takes its first snapshot stores the current epoch in its
+   slot and then checks that the current epoch hasn't moved.  If it has, a
+   scan could have missed the slot and cleaned up a version that the
+   snapshot needs, and so it tries again with the new epoch.  Scans read
+   the current epoch before they look at the slots for the same reason.
+*/
+
+struct Snapshot_Slot {
+    volatile Epoch epoch;   ///< Oldest epoch in use by the owner, or zero
+    volatile int owned;
+    char padding[64 - sizeof(Epoch) - sizeof(int)];
+};
+
+enum { MAX_SNAPSHOT_SLOTS = 4096 };
+
+Snapshot_Slot thread_slots[MAX_SNAPSHOT_SLOTS];
+
+/// Number of slots that have ever been claimed; those after it are unused
+volatile int num_thread_slots = 0;
+
+/// The snapshots taken by a thread.  Each snapshot remembers which one it
+/// is in, so that it can be finished (or moved) on another thread.
+struct Thread_Snapshots {
+    Thread_Snapshots() : slot(0), exited(false) {}
+
+    Snapshot_Slot * slot;
+    std::vector<Epoch> epochs;
+
+    /// Only contended when a snapshot is used on another thread
+    Spinlock lock;
+
+    /// The thread has gone while some of its snapshots are still alive;
+    /// the last of them to finish gives back the slot
+    bool exited;
+};
+
+__thread Thread_Snapshots * thread_snapshots = 0;
+
+pthread_key_t thread_snapshots_key;
+pthread_once_t thread_snapshots_once = PTHREAD_ONCE_INIT;
+
+/// Give back a slot that has no snapshots in it
+void release_slot(Thread_Snapshots * snapshots)
+{
+    snapshots->slot->epoch = 0;
+    memory_barrier();
+    snapshots->slot->owned = 0;
+    delete snapshots;
+}
+
+/// Give back the slot when the thread exits, or once the snapshots that
+/// it left behind have finished
+void release_thread_snapshots(void * arg)
+{
+    Thread_Snapshots * snapshots = reinterpret_cast<Thread_Snapshots *>(arg);
+    {
+        ACE_Guard<Spinlock> guard(snapshots->lock);
+        if (!snapshots->epochs.empty()) {
+            snapshots->exited = true;
+            return;
+        }
+    }
+
+    release_slot(snapshots);
+}
+
+void create_thread_snapshots_key()
+{
+    pthread_key_create(&thread_snapshots_key, &release_thread_snapshots);
+}
+
+Thread_Snapshots & get_thread_snapshots()
+{
+    if (JML_LIKELY(thread_snapshots != 0)) return *thread_snapshots;
+
+    pthread_once(&thread_snapshots_once, &create_thread_snapshots_key);
+
+    // Find a slot that nobody owns
+    Snapshot_Slot * slot = 0;
+    for (int i = 0;  i < MAX_SNAPSHOT_SLOTS && !slot;  ++i) {
+        if (thread_slots[i].owned
+            || !__sync_bool_compare_and_swap(&thread_slots[i].owned, 0, 1))
+            continue;
+        slot = &thread_slots[i];
+        for (int n = num_thread_slots;  n <= i;  n = num_thread_slots)
+            __sync_bool_compare_and_swap(&num_thread_slots, n, i + 1);
+    }
+
+    if (!slot)
+        throw Exception("too many threads using snapshot slots");
+
+    Thread_Snapshots * result = new Thread_Snapshots();
+    result->slot = slot;
+    thread_snapshots = result;
+    pthread_setspecific(thread_snapshots_key, result);
+    return *result;
+}
+
+/// Oldest epoch that a snapshot could be using
+Epoch oldest_slot_epoch()
+{
+    Epoch result = get_current_epoch();
+    memory_barrier();
+
+    int n = num_thread_slots;
+    for (int i = 0;  i < n;  ++i) {
+        Epoch epoch = thread_slots[i].epoch;
+        if (epoch != 0 && epoch < result) result = epoch;
+    }
+
+    return result;
+}
+
+void
+Snapshot_Info::
+set_snapshot_slots(bool use_slots)
+{
+    ACE_Guard<Mutex> guard(lock);
+
+    if (use_slots == this->use_slots) return;
+
+    if (!entries.empty())
+        throw Exception("can't change snapshot slots with snapshots");
+
+    if (this->use_slots) {
+        for (int i = 0;  i < num_thread_slots;  ++i)
+            if (thread_slots[i].epoch)
+                throw Exception("can't change snapshot slots with snapshots");
+        reclaim();
+        if (num_retired)
+            throw Exception("couldn't clean up retired versions");
+    }
+
+    this->use_slots = use_slots;
+}
+
+Epoch
+Snapshot_Info::
+register_slot_snapshot(Snapshot * snapshot, Epoch max_staleness)
+{
+    Thread_Snapshots & snapshots = get_thread_snapshots();
+    ACE_Guard<Spinlock> guard(snapshots.lock);
+
+    Epoch epoch = get_current_epoch();
+
+    // Our slot already protects the epochs of our other snapshots, so we
+    // can share the newest one if it's recent enough
+    if (max_staleness != 0 && !snapshots.epochs.empty()) {
+        Epoch newest = *std::max_element(snapshots.epochs.begin(),
+                                         snapshots.epochs.end());
+        if (newest + max_staleness >= epoch) epoch = newest;
+    }
+
+    // If we already have one that is older, it protects this one too
+    if (snapshots.epochs.empty()) {
+        for (;;) {
+            snapshots.slot->epoch = epoch;
+            memory_barrier();
+            Epoch current = get_current_epoch();
+            if (current == epoch) break;
+            epoch = current;
+        }
+    }
+
+    snapshots.epochs.push_back(epoch);
+    snapshot->epoch_ = epoch;
+    snapshot->slot_ = &snapshots;
+    return epoch;
+}
+
+void
+Snapshot_Info::
+remove_slot_snapshot(Snapshot * snapshot)
+{
+    // Not necessarily the current thread's, if the snapshot was handed on
+    Thread_Snapshots * snapshots = snapshot->slot_;
+    if (!snapshots)
+        throw Exception("snapshot not found in slot");
+
+    bool release = false;
+    {
+        ACE_Guard<Spinlock> guard(snapshots->lock);
+        std::vector<Epoch> & epochs = snapshots->epochs;
+
+        std::vector<Epoch>::iterator it
+            = std::find(epochs.begin(), epochs.end(), snapshot->epoch());
+        if (it == epochs.end())
+            throw Exception("snapshot not found in slot");
+
+        *it = epochs.back();
+        epochs.pop_back();
+        snapshot->slot_ = 0;
+
+        if (!epochs.empty()) {
+            snapshots->slot->epoch
+                = *std::min_element(epochs.begin(), epochs.end());
+            return;
+        }
+
+        snapshots->slot->epoch = 0;
+        release = snapshots->exited;
+    }
+
+    if (release) release_slot(snapshots);
+
+    // Only look at the shared state if there is something to clean up
+    if (num_retired) reclaim();
+}
+
+void
+Snapshot_Info::
+retire(Versioned_Object * obj, Epoch valid_from)
+{
+    Retired_Version version;
+    version.object = obj;
+    version.valid_from = valid_from;
+    version.retired = get_current_epoch();
+
+    ACE_Guard<Spinlock> guard(retired_lock);
+    retired.push_back(version);
+    num_retired = retired.size();
+}
+
+void
+Snapshot_Info::
+reclaim()
+{
+    Epoch oldest = oldest_slot_epoch();
+
+    std::vector<Retired_Version> to_clean_up;
+    {
+        ACE_Guard<Spinlock> guard(retired_lock);
+
+        int num_kept = 0;
+        for (unsigned i = 0;  i < retired.size();  ++i) {
+            if (retired[i].retired <= oldest)
+                to_clean_up.push_back(retired[i]);
+            else retired[num_kept++] = retired[i];
+        }
+        retired.resize(num_kept);
+        num_retired = num_kept;
+    }
+
+    // Others may be reclaiming too; don't let an older scan win
+    for (Epoch earliest = earliest_epoch_;  oldest > earliest;
+         earliest = earliest_epoch_)
+        __sync_bool_compare_and_swap(&earliest_epoch_, earliest, oldest);
+
+    // Nothing can see these any more
+    for (unsigned i = 0;  i < to_clean_up.size();  ++i)
+        to_clean_up[i].object->cleanup(to_clean_up[i].valid_from, oldest);
+}
+
 void
 Snapshot_Info::
 compress_epochs()
 {
     // We have to block any commits that are happening so that we can't get
     // any new epochs
-    ACE_Guard<ACE_Mutex> commit_guard(commit_lock);
+    if (commit_lock_held)
+        throw Exception("compress_epochs() with the commit lock held for "
+                        "writing would deadlock");
+
+    ACE_Write_Guard<Commit_Lock> commit_guard(commit_lock);
+
+    if (use_slots)
+        throw Exception("can't compress epochs with snapshot slots");
 
     ACE_Guard<Mutex> guard(lock);
     
@@ -467,25 +987,22 @@ compress_epochs()
 
     int i = 1; // starting epoch number
     for (Entries::iterator it = entries.begin(), end = entries.end();
-         it != end;  /* no inc it */ ++i) {
-        int old_epoch = it->first;
+         it != end;  ++it, ++i) {
+        Entry & entry = **it;
+        int old_epoch = entry.epoch;
         int new_epoch = i;
 
         if (debug)
             cerr << "renaming " << old_epoch << " to " << new_epoch << endl;
 
-        if (old_epoch == new_epoch) {
-            ++it;
+        if (old_epoch == new_epoch)
             continue;  // nothing to do
-        }
 
         if (new_epoch > old_epoch) {
             cerr << "new_epoch = " << new_epoch << endl;
             cerr << "old_epoch = " << old_epoch << endl;
             throw Exception("logic error in compress_epochs()");
         }
-        
-        Entry & entry = it->second;
 
         if (debug)
             cerr << entry.cleanups.size() << " cleanups" << endl;
@@ -569,24 +1086,21 @@ compress_epochs()
             dump_unlocked();
         }
 
-        for (set<Snapshot *>::iterator
-                 jt = entry.snapshots.begin(),
-                 jend = entry.snapshots.end();
-             jt != jend;  ++jt)
-            (*jt)->rename_epoch(old_epoch, new_epoch);
+        {
+            // Stop snapshots from joining or leaving while we rename
+            ACE_Guard<Spinlock> entry_guard(entry.lock);
 
-        // Make sure writes are visible before we continue
-        memory_barrier();
+            for (Snapshot * snapshot = entry.snapshots;  snapshot;
+                 snapshot = snapshot->next_)
+                snapshot->rename_epoch(old_epoch, new_epoch);
 
-        if (entries.count(new_epoch))
-            throw Exception("new epoch already there");
-        Entry & new_entry = entries[new_epoch];
-        new_entry.snapshots.swap(entry.snapshots);
-        new_entry.cleanups.swap(entry.cleanups);
+            // Make sure writes are visible before we continue
+            memory_barrier();
 
-        Entries::iterator new_it = boost::next(it);
-        entries.erase(it);
-        it = new_it;
+            // Entries stay in the same order, so it can be renamed in
+            // place
+            entry.epoch = new_epoch;
+        }
     }
 
     if (debug) {
@@ -596,6 +1110,9 @@ compress_epochs()
 
     current_epoch_ = i;
     earliest_epoch_ = 1;
+
+    // Epochs taken by snapshots that aren't registered now mean nothing
+    ++epoch_compressions;
 }
 
 void
@@ -610,20 +1127,16 @@ dump_unlocked(std::ostream & stream)
            << (current_trans ? current_trans->epoch() : 0)
            << endl;
     stream << "  snapshot epochs: " << entries.size() << endl;
-    int i = 0;
-    for (map<Epoch, Entry>::const_iterator
-             it = entries.begin(), end = entries.end();
-         it != end;  ++it, ++i) {
-        const Entry & entry = it->second;
-        stream << "  " << i << " at epoch " << it->first << endl;
-        stream << "    " << entry.snapshots.size() << " snapshots"
+    for (unsigned i = 0;  i < entries.size();  ++i) {
+        const Entry & entry = *entries[i];
+        stream << "  " << i << " at epoch " << entry.epoch << endl;
+        stream << "    " << entry.num_snapshots << " snapshots"
              << endl;
         int j = 0;
-        for (set<Snapshot *>::const_iterator
-                 jt = entry.snapshots.begin(), jend = entry.snapshots.end();
-             jt != jend;  ++jt, ++j)
-            stream << "      " << j << " " << *jt << " epoch "
-                   << (*jt)->epoch() << " status " << (*jt)->status
+        for (const Snapshot * snapshot = entry.snapshots;  snapshot;
+             snapshot = snapshot->next_, ++j)
+            stream << "      " << j << " " << snapshot << " epoch "
+                   << snapshot->epoch() << " status " << snapshot->status
                    << endl;
         stream << "    " << entry.cleanups.size() << " cleanups" << endl;
         for (unsigned j = 0;  j < entry.cleanups.size();  ++j)
@@ -652,16 +1165,16 @@ Snapshot_Info::
 has_cleanup(Epoch snapshot_epoch, const Versioned_Object * object) const
 {
     ACE_Guard<Mutex> guard (lock);
-    Entries::const_iterator it = entries.find(snapshot_epoch);
-
-    if (it == entries.end()) return 0;
+    for (unsigned i = 0;  i < entries.size();  ++i) {
+        if (entries[i]->epoch != snapshot_epoch) continue;
 
-    for (Cleanups::const_iterator
-             jt = it->second.cleanups.begin(),
-             jend = it->second.cleanups.end();
-         jt != jend;  ++jt)
-        if (jt->object == object)
-            return jt->valid_from;
+        const Cleanups & cleanups = entries[i]->cleanups;
+        for (Cleanups::const_iterator
+                 jt = cleanups.begin(), jend = cleanups.end();
+             jt != jend;  ++jt)
+            if (jt->object == object)
+                return jt->valid_from;
+    }
 
     return 0;
 }
@@ -704,4 +1217,44 @@ rename_epoch(Epoch old_epoch, Epoch new_epoch)
     epoch_ = new_epoch;
 }
 
+bool
+Snapshot::
+check_lazy_read()
+{
+    // A version that we shouldn't see is only cleaned up after the epoch
+    // that replaced it is published, so if there is no new epoch after
+    // the read then we saw the right one.  One that was installed but not
+    // yet published doesn't matter as it's not valid at our epoch.
+    memory_barrier();
+    if (get_current_epoch() != epoch_
+        || compressions_ != epoch_compressions)
+        return false;
+
+    read_lazily_ = true;
+    return true;
+}
+
+bool
+Snapshot::
+register_lazily()
+{
+    if (is_registered_) return true;
+
+    Epoch old_epoch = epoch_;
+    unsigned old_compressions = compressions_;
+
+    register_me();
+
+    // We can't tell whether what was read has changed since old_epoch,
+    // as the history that would say so might already be gone
+    bool consistent
+        = !read_lazily_
+        || (epoch_ == old_epoch && old_compressions == epoch_compressions);
+    read_lazily_ = false;
+
+    if (!consistent) lazy_ = false;
+
+    return consistent;
+}
+
 } // namespace JMVCC
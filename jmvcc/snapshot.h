@@ -9,8 +9,7 @@
 #define __jmvcc__snapshot_h__
 
 #include "jml/arch/exception.h"
-#include <map>
-#include <set>
+#include <deque>
 #include <vector>
 #include <iostream>
 #include <ace/Mutex.h>
@@ -44,6 +43,24 @@ inline void set_current_epoch(Epoch val)
     current_epoch_ = val;
 }
 
+/** Reserve an epoch number for a commit.  Several commits may hold
+    reserved epochs at once; they are handed out in increasing order and
+    must be made current in that same order via publish_epoch().
+*/
+Epoch reserve_epoch();
+
+/** Make the given reserved epoch the current epoch.  Waits until all of
+    the epochs reserved before it have been published, so that the
+    current epoch never skips over a commit that is still in progress.
+*/
+void publish_epoch(Epoch epoch);
+
+/** Give back a reserved epoch that didn't end up being used.  If a later
+    epoch has already been reserved, the epoch is published with nothing
+    in it instead so that the later one isn't blocked.
+*/
+void release_epoch(Epoch epoch);
+
 /// Global variable giving the earliest epoch for which there is a snapshot
 extern Epoch earliest_epoch_;
 
@@ -66,6 +83,10 @@ inline Epoch get_earliest_epoch()
     return earliest_epoch_;
 }
 
+/// Number of times that the epochs have been compressed, which changes
+/// what every epoch number means
+extern volatile unsigned epoch_compressions;
+
 
 /*****************************************************************************/
 /* SNAPSHOT_INFO                                                             */
@@ -84,15 +105,36 @@ inline Epoch get_earliest_epoch()
 
 /// Information about transactions in progress
 struct Snapshot_Info {
+    Snapshot_Info();
+
+    ~Snapshot_Info();
+
     // Register the snapshot for the current epoch.  Returns the number of
-    // the epoch it was registered under.
-    Epoch register_snapshot(Snapshot * snapshot);
+    // the epoch it was registered under.  If max_staleness is non-zero,
+    // the snapshot may instead join one that is already registered at an
+    // epoch up to that many epochs old.
+    Epoch register_snapshot(Snapshot * snapshot, Epoch max_staleness = 0);
 
     void remove_snapshot(Snapshot * snapshot);
 
     void register_cleanup(Versioned_Object * obj,
                           Epoch valid_from_to_cleanup);
 
+    /** While one of these is alive, the cleanups registered by the thread
+        are held back and then registered all at once when it is
+        destroyed, rather than taking the lock for each one.  Used by
+        commits that write a lot of objects.  Batches can be nested; only
+        the outermost one does anything. */
+    struct Cleanup_Batch : boost::noncopyable {
+        Cleanup_Batch();
+        ~Cleanup_Batch();
+
+    private:
+        friend struct Snapshot_Info;
+        bool active;
+        std::vector<std::pair<Versioned_Object *, Epoch> > cleanups;
+    };
+
     void dump(std::ostream & stream = std::cerr);
 
     void validate() const
@@ -110,6 +152,24 @@ struct Snapshot_Info {
     */
     void compress_epochs();
 
+    /** Keep track of snapshots using one slot per thread instead of the
+        registry.  A thread publishes the oldest epoch that it has a
+        snapshot of in its own slot, so starting and finishing snapshots
+        doesn't write anything that is shared.  Old versions are instead
+        cleaned up in bulk once a scan of the slots shows that no snapshot
+        could still see them, which means that a long-lived snapshot
+        holds up the cleanup of everything committed after it.  Epochs
+        can't be compressed in this mode.
+
+        A snapshot stays in the slot of the thread that registered it,
+        even if it is finished on another thread, and a thread that exits
+        keeps its slot until the snapshots that it left behind finish.
+
+        Can only be changed when there are no snapshots. */
+    void set_snapshot_slots(bool use_slots);
+
+    bool snapshot_slots() const { return use_slots; }
+
     /** For testing.  Check if the given epoch has the given object in it,
         and returns the valid_from of that object.  Slow and inefficient. */
     Epoch has_cleanup(Epoch snapshot_epoch,
@@ -133,24 +193,100 @@ private:
     typedef std::vector<Cleanup_Entry> Cleanups;
 
     struct Entry {
-        std::set<Snapshot *> snapshots;
+        Entry() : epoch(0), snapshots(0), num_snapshots(0)
+        {
+        }
+
+        Epoch epoch;
+
+        /// Snapshots registered at the epoch, linked through the snapshots
+        /// themselves so that joining and leaving don't allocate
+        Snapshot * snapshots;
+        int num_snapshots;
+
         Cleanups cleanups;
 
+        void add_snapshot(Snapshot * snapshot);
+
+        /// Returns the number of snapshots left
+        int remove_snapshot(Snapshot * snapshot);
+
+        /// Add the snapshot if we are still in use and for the current
+        /// epoch, or within max_staleness of it.  Needs only our own lock.
+        bool join(Snapshot * snapshot, Epoch max_staleness);
+
+        /// Remove the snapshot if it's not the last one.  Needs only our
+        /// own lock.
+        bool leave(Snapshot * snapshot);
+
+        void link(Snapshot * snapshot);
+        void unlink(Snapshot * snapshot);
+
         void add_cleanup(const Cleanup_Entry & cleanup);
+
+        template<class Iterator>
+        void add_cleanups(Iterator first, Iterator last);
+
+        /// Protects the snapshots and cleanups.  Taken after the registry
+        /// lock when both are needed.
         mutable Spinlock lock;
     };
 
-    typedef std::map<Epoch, Entry> Entries;
+    /// The entries in order of epoch.  Snapshots are always registered at
+    /// the current epoch, so new entries only ever go on the end, and the
+    /// oldest snapshots usually finish first, so most are removed from the
+    /// front.  The entries themselves don't move, so that a snapshot can
+    /// hold on to its own.
+    typedef std::deque<Entry *> Entries;
     Entries entries;
 
+    /// Entries no longer in use, kept to save allocating new ones.  They
+    /// are never freed (until we are), so it's safe to look at one that
+    /// might have just been retired.
+    std::vector<Entry *> spare_entries;
+
+    /// The last entry, which new snapshots can join without the lock
+    Entry * volatile newest_entry;
+
+    Entry * new_entry(Epoch epoch);
+
+    /// Find the position of the given entry
+    Entries::iterator find_entry(const Entry * entry);
+
     void dump_unlocked(std::ostream & stream = std::cerr);
 
     void validate_unlocked() const;
 
     void perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard);
+
+    /// Register a whole batch of cleanups
+    void register_cleanups(const Cleanup_Batch & batch);
+
+    // Snapshot slot mode
+
+    bool use_slots;
+
+    struct Retired_Version {
+        Versioned_Object * object;
+        Epoch valid_from;
+        Epoch retired;   ///< No snapshot from this epoch on can see it
+    };
+
+    /// Versions waiting for the snapshots that can see them to finish
+    std::vector<Retired_Version> retired;
+    Spinlock retired_lock;
+    volatile size_t num_retired;
+
+    Epoch register_slot_snapshot(Snapshot * snapshot, Epoch max_staleness);
+    void remove_slot_snapshot(Snapshot * snapshot);
+    void retire(Versioned_Object * obj, Epoch valid_from);
+
+    /// Clean up whatever no snapshot can see any more
+    void reclaim();
     
     friend class ::test0;
     template<class Var> friend void test0_type();
+    friend class Snapshot;
 };
 
 extern Snapshot_Info snapshot_info;
@@ -178,6 +314,15 @@ enum Status {
 
 std::ostream & operator << (std::ostream & stream, const Status & status);
 
+/// When a snapshot gets registered
+enum Registration {
+    REGISTER_NOW,     ///< As soon as it is taken
+    REGISTER_LAZILY   ///< Only once it needs to be; see Snapshot
+};
+
+/// The snapshots of a thread in snapshot slot mode
+struct Thread_Snapshots;
+
 /*****************************************************************************/
 /* SNAPSHOT                                                                  */
 /*****************************************************************************/
@@ -189,6 +334,26 @@ std::ostream & operator << (std::ostream & stream, const Status & status);
 struct Snapshot : boost::noncopyable {
     Snapshot();
 
+    /** Take a snapshot that can be up to max_staleness epochs older than
+        the current epoch.  Joining one that is already registered is
+        cheaper than registering a new one, and doesn't contend with
+        anything else that is starting or finishing a snapshot.  A
+        restart always moves to the current epoch. */
+    explicit Snapshot(Epoch max_staleness);
+
+    /** Take a snapshot that, with REGISTER_LAZILY, isn't registered until
+        it needs to be.  As long as nothing has been committed since its
+        epoch, the latest version of everything that it reads is the one
+        that it would see anyway, and nothing needs to be kept around for
+        it.  Once something has, it is registered at the current epoch
+        instead, which is only consistent if it hasn't read anything yet;
+        register_lazily() says whether that's so.  Moving on after a
+        commit or a restart starts off unregistered again, unless what
+        was read turned out to be inconsistent.  It then registers
+        straight away, so that it can't keep on failing, until
+        resume_lazy_registration() is called after a successful commit. */
+    explicit Snapshot(Registration registration);
+
     ~Snapshot();
 
     void restart();
@@ -201,12 +366,49 @@ struct Snapshot : boost::noncopyable {
 
     void rename_epoch(Epoch old_epoch, Epoch new_epoch);
 
+    /// Is the snapshot in the registry (which it always is unless it was
+    /// taken with REGISTER_LAZILY)?
+    bool is_registered() const { return is_registered_; }
+
+    /** For a snapshot that isn't registered yet, call after reading an
+        object at our epoch.  Returns true if what was read is right,
+        which is when nothing has been committed since.  Otherwise the
+        snapshot needs to be registered before the object is read
+        again. */
+    bool check_lazy_read();
+
+    /** Register a snapshot that isn't registered yet at the current
+        epoch.  Returns false if it read something before then and the
+        epoch has moved on since, in which case what was read doesn't
+        necessarily belong to the new one. */
+    bool register_lazily();
+
+    /** Go back to registering lazily after an inconsistent read made the
+        snapshot register straight away.  Does nothing unless it was taken
+        with REGISTER_LAZILY. */
+    void resume_lazy_registration() { lazy_ = lazy_requested_; }
+
 private:
     friend class Snapshot_Info;
     Epoch epoch_;  ///< Epoch at which snapshot was taken
     int retries_;
 
-    void register_me();
+    // Lazy registration
+    bool lazy_;
+    bool lazy_requested_;     ///< Taken with REGISTER_LAZILY
+    bool is_registered_;
+    bool read_lazily_;        ///< Read something before being registered
+    unsigned compressions_;   ///< epoch_compressions when epoch_ was taken
+
+    void start_lazily();
+
+    // Where we are registered; looked after by the Snapshot_Info
+    Snapshot_Info::Entry * entry_;
+    Snapshot * prev_;
+    Snapshot * next_;
+    Thread_Snapshots * slot_;   ///< In slot mode
+
+    void register_me(Epoch max_staleness = 0);
 
 public:
     Status status;
@@ -18,16 +18,37 @@ namespace JMVCC {
 inline
 Snapshot::
 Snapshot()
-    : retries_(0), status(UNINITIALIZED)
+    : retries_(0), lazy_(false), lazy_requested_(false), is_registered_(false),
+      entry_(0), prev_(0), next_(0), slot_(0), status(UNINITIALIZED)
 {
     register_me();
 }
 
+inline
+Snapshot::
+Snapshot(Epoch max_staleness)
+    : retries_(0), lazy_(false), lazy_requested_(false), is_registered_(false),
+      entry_(0), prev_(0), next_(0), slot_(0), status(UNINITIALIZED)
+{
+    register_me(max_staleness);
+}
+
+inline
+Snapshot::
+Snapshot(Registration registration)
+    : retries_(0), lazy_(registration == REGISTER_LAZILY),
+      lazy_requested_(lazy_), is_registered_(false), entry_(0), prev_(0),
+      next_(0), slot_(0), status(UNINITIALIZED)
+{
+    if (lazy_) start_lazily();
+    else register_me();
+}
+
 inline
 Snapshot::
 ~Snapshot()
 {
-    snapshot_info.remove_snapshot(this);
+    if (is_registered_) snapshot_info.remove_snapshot(this);
 }
 
 inline
@@ -43,9 +64,10 @@ restart()
 inline
 void
 Snapshot::
-register_me()
+register_me(Epoch max_staleness)
 {
-    snapshot_info.register_snapshot(this);
+    snapshot_info.register_snapshot(this, max_staleness);
+    is_registered_ = true;
 
     if (status == UNINITIALIZED)
         status = INITIALIZED;
@@ -58,12 +80,38 @@ void
 Snapshot::
 set_epoch(Epoch new_epoch)
 {
+    // A lazy one starts again unregistered, even if the epoch hasn't
+    // changed, as it has nothing to keep from what it read before
+    if (lazy_) {
+        if (is_registered_) {
+            snapshot_info.remove_snapshot(this);
+            is_registered_ = false;
+        }
+        start_lazily();
+        return;
+    }
+
     if (new_epoch != epoch_) {
         snapshot_info.remove_snapshot(this);
         register_me();
     }        
 }
 
+inline
+void
+Snapshot::
+start_lazily()
+{
+    compressions_ = epoch_compressions;
+    epoch_ = get_current_epoch();
+    read_lazily_ = false;
+
+    if (status == UNINITIALIZED)
+        status = INITIALIZED;
+    else if (status == RESTARTING)
+        status = RESTARTED;
+}
+
 
 } // namespace JMVCC
 
@@ -577,7 +577,7 @@ struct Object_Test_Thread2 {
                     total += vars[i].read();
 
                 if (total != 0) {
-                    ACE_Guard<ACE_Mutex> guard(commit_lock);
+                    ACE_Write_Guard<Commit_Lock> guard(commit_lock);
                     cerr << "--------------- total not zero" << endl;
                     snapshot_info.dump();
                     cerr << "total is " << total << endl;
@@ -28,6 +28,9 @@
 #include "jmvcc/transaction.h"
 #include "jmvcc/versioned.h"
 #include "jmvcc/versioned2.h"
+#include "jmvcc/contention.h"
+#include "jmvcc/versioned_counter.h"
+#include "jmvcc/versioned_merge.h"
 #include "jml/arch/demangle.h"
 
 using namespace ML;
@@ -87,9 +90,9 @@ void test0_type()
         
         // Check that the snapshot is properly there
         BOOST_REQUIRE_EQUAL(snapshot_info.entry_count(), 1);
-        BOOST_CHECK_EQUAL(snapshot_info.entries.begin()->first, get_current_epoch());
-        BOOST_REQUIRE_EQUAL(snapshot_info.entries.begin()->second.snapshots.size(), 1);
-        BOOST_CHECK_EQUAL(*snapshot_info.entries.begin()->second.snapshots.begin(), &trans1);
+        BOOST_CHECK_EQUAL(snapshot_info.entries.front()->epoch, get_current_epoch());
+        BOOST_REQUIRE_EQUAL(snapshot_info.entries.front()->num_snapshots, 1);
+        BOOST_CHECK_EQUAL(snapshot_info.entries.front()->snapshots, &trans1);
         
         // Check that the correct value is copied over
         BOOST_CHECK_EQUAL(myval.mutate(), 6);
@@ -109,10 +112,10 @@ void test0_type()
 
         // Check that the snapshot is properly there
         BOOST_REQUIRE_EQUAL(snapshot_info.entry_count(), 1);
-        BOOST_CHECK_EQUAL(snapshot_info.entries.begin()->first,
+        BOOST_CHECK_EQUAL(snapshot_info.entries.front()->epoch,
                           get_current_epoch());
-        BOOST_REQUIRE_EQUAL(snapshot_info.entries.begin()->second.snapshots.size(), 1);
-        BOOST_CHECK_EQUAL(*snapshot_info.entries.begin()->second.snapshots.begin(), &trans1);
+        BOOST_REQUIRE_EQUAL(snapshot_info.entries.front()->num_snapshots, 1);
+        BOOST_CHECK_EQUAL(snapshot_info.entries.front()->snapshots, &trans1);
         
         // Finish the transaction without committing it
     }
@@ -533,13 +536,15 @@ struct Object_Test_Thread2 {
     int iter;
     boost::barrier & barrier;
     size_t & failures;
+    bool cache_reads;
 
     Object_Test_Thread2(Var * vars,
                         int nvars,
                         int iter, boost::barrier & barrier,
-                        size_t & failures)
+                        size_t & failures,
+                        bool cache_reads = false)
         : vars(vars), nvars(nvars), iter(iter), barrier(barrier),
-          failures(failures)
+          failures(failures), cache_reads(cache_reads)
     {
     }
     
@@ -559,6 +564,7 @@ struct Object_Test_Thread2 {
 
             while (!succeeded) {
                 Local_Transaction trans;
+                if (cache_reads) trans.set_cache_reads(true);
                 
                 // Now that we're inside, the total should be zero
                 ssize_t total = 0;
@@ -567,7 +573,7 @@ struct Object_Test_Thread2 {
                     total += vars[i].read();
 
                 if (total != 0) {
-                    ACE_Guard<ACE_Mutex> guard(commit_lock);
+                    ACE_Write_Guard<Commit_Lock> guard(commit_lock);
                     cerr << "--------------- total not zero" << endl;
                     snapshot_info.dump();
                     cerr << "total is " << total << endl;
@@ -599,11 +605,13 @@ struct Object_Test_Thread2 {
 };
 
 template<class Var>
-void run_object_test2(int nthreads, int niter, int nvals)
+void run_object_test2(int nthreads, int niter, int nvals,
+                      bool cache_reads = false)
 {
     cerr << endl << "testing 2 with " << nthreads << " threads and "
          << niter << " iter"
-         << " class " << demangle(typeid(Var).name()) << endl;
+         << " class " << demangle(typeid(Var).name())
+         << (cache_reads ? " with cached reads" : "") << endl;
     Var vals[nvals];
     boost::barrier barrier(nthreads);
     boost::thread_group tg;
@@ -613,7 +621,8 @@ void run_object_test2(int nthreads, int niter, int nvals)
     Timer timer;
     for (unsigned i = 0;  i < nthreads;  ++i)
         tg.create_thread(Object_Test_Thread2<Var>(vals, nvals, niter,
-                                                  barrier, failures));
+                                                  barrier, failures,
+                                                  cache_reads));
     
     tg.join_all();
 
@@ -667,4 +676,458 @@ BOOST_AUTO_TEST_CASE( test2 )
          << "s" << endl;
 }
 
+BOOST_AUTO_TEST_CASE( test2_cached )
+{
+    cerr << endl << endl << "========= test 2: multiple variables, cached"
+         << endl;
+
+    // Each transaction reads every variable, so the read cache is used
+    run_object_test2<Versioned<int> >(2,  5000, 2, true);
+    run_object_test2<Versioned<int> >(10, 10000, 100, true);
+    run_object_test2<Versioned<int> >(100, 1000, 10, true);
+}
+
 #endif
+
+template<class Var>
+void disjoint_test_thread(Var * vars, int nvars, int iter,
+                          boost::barrier & barrier,
+                          size_t & failures)
+{
+    // Wait for all threads to start up before we continue
+    barrier.wait();
+
+    int local_failures = 0;
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        Local_Transaction trans;
+        int tries = 0;
+        do {
+            ++tries;
+            for (unsigned j = 0;  j < nvars;  ++j)
+                vars[j].mutate() += 1;
+        } while (!trans.commit());
+
+        local_failures += tries - 1;
+    }
+
+    static Lock lock;
+    Guard guard(lock);
+
+    failures += local_failures;
+}
+
+template<class Var>
+void run_disjoint_test(int nthreads, int niter, int nvars)
+{
+    cerr << endl << "testing disjoint with " << nthreads << " threads and "
+         << niter << " iter"
+         << " class " << demangle(typeid(Var).name()) << endl;
+
+    // Each thread gets its own set of variables, so there should never be
+    // any conflicts even though the commits happen at the same time
+    Var vals[nthreads * nvars];
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    size_t failures = 0;
+
+    Epoch starting_epoch = get_current_epoch();
+
+    Timer timer;
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&disjoint_test_thread<Var>,
+                                     vals + i * nvars, nvars, niter,
+                                     boost::ref(barrier),
+                                     boost::ref(failures)));
+    
+    tg.join_all();
+
+    cerr << "elapsed: " << timer.elapsed() << endl;
+
+    BOOST_CHECK_EQUAL(failures, 0);
+
+    // Group commits can put several transactions in the same epoch
+    if (get_commit_mode() == PARALLEL_COMMIT)
+        BOOST_CHECK_EQUAL(get_current_epoch(),
+                          starting_epoch + nthreads * niter);
+    else BOOST_CHECK_LE(get_current_epoch(),
+                        starting_epoch + nthreads * niter);
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+
+    {
+        Local_Transaction trans;
+        for (unsigned i = 0;  i < nthreads * nvars;  ++i) {
+            BOOST_CHECK_EQUAL(vals[i].read(), niter);
+            BOOST_CHECK_EQUAL(vals[i].history_size(), 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test3 )
+{
+    cerr << endl << endl << "========= test 3: disjoint parallel commits"
+         << endl;
+
+    run_disjoint_test<Versioned<int> >(10, 10000, 2);
+    run_disjoint_test<Versioned2<int> >(10, 10000, 2);
+    run_disjoint_test<Versioned<int> >(100, 1000, 5);
+    run_disjoint_test<Versioned2<int> >(100, 1000, 5);
+}
+
+BOOST_AUTO_TEST_CASE( test4 )
+{
+    cerr << endl << endl << "========= test 4: group commit" << endl;
+
+    set_commit_mode(GROUP_COMMIT);
+
+    run_object_test<Versioned<int> >(10, 10000);
+    run_object_test<Versioned2<int> >(10, 10000);
+    run_object_test2<Versioned<int> >(10, 10000, 100);
+    run_object_test2<Versioned2<int> >(100, 1000, 10);
+    run_disjoint_test<Versioned<int> >(10, 10000, 2);
+    run_disjoint_test<Versioned2<int> >(100, 1000, 5);
+
+    set_commit_mode(PARALLEL_COMMIT);
+}
+
+template<class Var>
+void overwrite_test_thread(Var & var, int thread, int iter,
+                           boost::barrier & barrier,
+                           size_t & failures)
+{
+    barrier.wait();
+
+    int local_failures = 0;
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        Local_Transaction trans;
+        do {
+            var.write(thread * iter + i);
+        } while (!trans.commit() && ++local_failures);
+    }
+
+    static Lock lock;
+    Guard guard(lock);
+
+    failures += local_failures;
+}
+
+template<class Var>
+void run_overwrite_test(int nthreads, int niter)
+{
+    cerr << endl << "testing last writer wins with " << nthreads
+         << " threads and " << niter << " iter"
+         << " class " << demangle(typeid(Var).name()) << endl;
+
+    // Everyone overwrites the same variable, which never conflicts
+    Var var(-1);
+    var.set_last_writer_wins(true);
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    size_t failures = 0;
+
+    for (int i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&overwrite_test_thread<Var>,
+                                     boost::ref(var), i, niter,
+                                     boost::ref(barrier),
+                                     boost::ref(failures)));
+    
+    tg.join_all();
+
+    BOOST_CHECK_EQUAL(failures, 0);
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+
+    // Whoever committed last did so with their last value
+    Local_Transaction trans;
+    BOOST_CHECK_EQUAL(var.read() % niter, niter - 1);
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test8 )
+{
+    cerr << endl << endl << "========= test 8: group commit last writer wins"
+         << endl;
+
+    set_commit_mode(GROUP_COMMIT);
+
+    run_overwrite_test<Versioned<int> >(10, 10000);
+    run_overwrite_test<Versioned2<int> >(10, 10000);
+
+    set_commit_mode(PARALLEL_COMMIT);
+}
+
+typedef Versioned_Merge<int, Max_Merge<int> > Watermark;
+
+void merge_test_thread(Watermark & watermark, int thread, int iter,
+                       boost::barrier & barrier,
+                       size_t & failures)
+{
+    barrier.wait();
+
+    int local_failures = 0;
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        Local_Transaction trans;
+        do {
+            int & value = watermark.mutate();
+            value = std::max(value, int(i * 100 + thread));
+        } while (!trans.commit() && ++local_failures);
+    }
+
+    static Lock lock;
+    Guard guard(lock);
+
+    failures += local_failures;
+}
+
+void run_merge_test(int nthreads, int niter)
+{
+    cerr << endl << "testing merges with " << nthreads << " threads and "
+         << niter << " iter" << endl;
+
+    // Everyone raises the same high watermark; the writes are merged so
+    // nobody should ever fail
+    Watermark watermark(-1);
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    size_t failures = 0;
+
+    for (int i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&merge_test_thread,
+                                     boost::ref(watermark), i, niter,
+                                     boost::ref(barrier),
+                                     boost::ref(failures)));
+    
+    tg.join_all();
+
+    BOOST_CHECK_EQUAL(failures, 0);
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+
+    Local_Transaction trans;
+    BOOST_CHECK_EQUAL(watermark.read(), (niter - 1) * 100 + nthreads - 1);
+    BOOST_CHECK_EQUAL(watermark.history_size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test7 )
+{
+    cerr << endl << endl << "========= test 7: group commit merges" << endl;
+
+    run_merge_test(10, 1000);
+
+    set_commit_mode(GROUP_COMMIT);
+    run_merge_test(10, 1000);
+    set_commit_mode(PARALLEL_COMMIT);
+}
+
+template<class Var>
+void increment_var(Var & var)
+{
+    var.mutate() += 1;
+}
+
+template<class Var>
+void contended_test_thread(Var & var, int iter,
+                           const Backoff_Policy & policy,
+                           boost::barrier & barrier,
+                           size_t & committed)
+{
+    barrier.wait();
+
+    size_t local_committed = 0;
+
+    for (unsigned i = 0;  i < iter;  ++i)
+        local_committed
+            += run_transaction(boost::bind(&increment_var<Var>,
+                                           boost::ref(var)),
+                               policy);
+
+    static Lock lock;
+    Guard guard(lock);
+
+    committed += local_committed;
+}
+
+template<class Var>
+void run_contended_test(int nthreads, int niter,
+                        const Backoff_Policy & policy)
+{
+    cerr << endl << "testing run_transaction with " << nthreads
+         << " threads and " << niter << " iter"
+         << " class " << demangle(typeid(Var).name()) << endl;
+
+    // Every thread increments the same variable, so there is lots of
+    // contention for the backoff and serialization to deal with
+    Var var(0);
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    size_t committed = 0;
+
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&contended_test_thread<Var>,
+                                     boost::ref(var), niter,
+                                     boost::cref(policy),
+                                     boost::ref(barrier),
+                                     boost::ref(committed)));
+    
+    tg.join_all();
+
+    // With no retry limit every transaction must eventually commit
+    if (policy.max_retries == -1)
+        BOOST_CHECK_EQUAL(committed, nthreads * niter);
+
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+
+    Local_Transaction trans;
+    BOOST_CHECK_EQUAL(var.read(), committed);
+}
+
+BOOST_AUTO_TEST_CASE( test5 )
+{
+    cerr << endl << endl << "========= test 5: run_transaction" << endl;
+
+    Backoff_Policy policy;
+    run_contended_test<Versioned<int> >(10, 1000, policy);
+    run_contended_test<Versioned2<int> >(10, 1000, policy);
+
+    // Serialize quickly so that the serialized path gets exercised
+    policy.serialize_after = 2;
+    run_contended_test<Versioned<int> >(10, 1000, policy);
+    run_contended_test<Versioned2<int> >(10, 1000, policy);
+
+    // Give up straight away; whatever did commit must be counted exactly
+    policy.serialize_after = -1;
+    policy.max_retries = 0;
+    run_contended_test<Versioned<int> >(10, 1000, policy);
+    run_contended_test<Versioned2<int> >(10, 1000, policy);
+}
+
+void counter_test_thread(Versioned_Counter<int> & counter, int iter,
+                         boost::barrier & barrier,
+                         size_t & failures)
+{
+    barrier.wait();
+
+    int local_failures = 0;
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        Local_Transaction trans;
+        do {
+            counter.increment();
+        } while (!trans.commit() && ++local_failures);
+    }
+
+    static Lock lock;
+    Guard guard(lock);
+
+    failures += local_failures;
+}
+
+void run_counter_test(int nthreads, int niter)
+{
+    cerr << endl << "testing counter with " << nthreads << " threads and "
+         << niter << " iter" << endl;
+
+    // Everyone increments the same counter, but as increments commute
+    // nobody should ever fail
+    Versioned_Counter<int> counter(0);
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    size_t failures = 0;
+
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&counter_test_thread,
+                                     boost::ref(counter), niter,
+                                     boost::ref(barrier),
+                                     boost::ref(failures)));
+    
+    tg.join_all();
+
+    BOOST_CHECK_EQUAL(failures, 0);
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+
+    Local_Transaction trans;
+    BOOST_CHECK_EQUAL(counter.read(), nthreads * niter);
+    BOOST_CHECK_EQUAL(counter.history_size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test6 )
+{
+    cerr << endl << endl << "========= test 6: counters" << endl;
+
+    run_counter_test(10, 10000);
+
+    set_commit_mode(GROUP_COMMIT);
+    run_counter_test(10, 10000);
+    set_commit_mode(PARALLEL_COMMIT);
+}
+
+BOOST_AUTO_TEST_CASE( test9 )
+{
+    cerr << endl << endl << "========= test 9: snapshot slots" << endl;
+
+    snapshot_info.set_snapshot_slots(true);
+
+    run_object_test2<Versioned<int> >(10, 10000, 100);
+    run_object_test2<Versioned2<int> >(100, 1000, 10);
+    run_disjoint_test<Versioned<int> >(10, 10000, 2);
+
+    set_commit_mode(GROUP_COMMIT);
+    run_object_test2<Versioned<int> >(10, 10000, 100);
+    set_commit_mode(PARALLEL_COMMIT);
+
+    snapshot_info.set_snapshot_slots(false);
+}
+
+/// Takes a snapshot for another thread to carry on with
+void take_snapshot(auto_ptr<Transaction> & result)
+{
+    result.reset(new Transaction(false /* use_critical */));
+}
+
+BOOST_AUTO_TEST_CASE( test10 )
+{
+    cerr << endl << endl << "========= test 10: snapshot slots across threads"
+         << endl;
+
+    snapshot_info.set_snapshot_slots(true);
+
+    Versioned<int> var(0);
+    {
+        Local_Transaction trans;
+        var.write(1);
+        BOOST_CHECK(trans.commit());
+    }
+
+    // The thread that took it has exited, but the snapshot still holds on
+    // to its slot, so what it can see isn't cleaned up
+    auto_ptr<Transaction> snapshot;
+    boost::thread thread(boost::bind(&take_snapshot, boost::ref(snapshot)));
+    thread.join();
+
+    {
+        Local_Transaction trans;
+        var.write(2);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(var.history_size(), 1);
+
+    current_trans = snapshot.get();
+    BOOST_CHECK_EQUAL(var.read(), 1);
+
+    // It can be moved on and finished here
+    snapshot->restart();
+    BOOST_CHECK_EQUAL(var.read(), 2);
+
+    current_trans = 0;
+    snapshot.reset();
+
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+
+    snapshot_info.set_snapshot_slots(false);
+}
@@ -28,6 +28,9 @@
 #include "jmvcc/transaction.h"
 #include "jmvcc/versioned.h"
 #include "jmvcc/versioned2.h"
+#include "jmvcc/contention.h"
+#include "jmvcc/versioned_counter.h"
+#include "jmvcc/versioned_merge.h"
 
 using namespace ML;
 using namespace JMVCC;
@@ -233,3 +236,1442 @@ BOOST_AUTO_TEST_CASE( test1 )
 
     do_versioned_test<Versioned2<int> >();
 }
+
+template<class Var>
+void do_read_only_test()
+{
+    Var var(3);
+
+    Epoch starting_epoch = get_current_epoch();
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(var.read(), 3);
+        BOOST_CHECK(trans.commit());
+
+        // Nothing was written, so no new epoch was needed
+        BOOST_CHECK_EQUAL(get_current_epoch(), starting_epoch);
+        BOOST_CHECK_EQUAL(trans.epoch(), starting_epoch);
+        BOOST_CHECK_EQUAL(var.read(), 3);
+
+        {
+            Local_Transaction writer;
+            var.write(4);
+            BOOST_CHECK(writer.commit());
+        }
+
+        // We still see our snapshot until we commit...
+        BOOST_CHECK_EQUAL(var.read(), 3);
+        BOOST_CHECK(trans.commit());
+
+        // ... and then move on to the current epoch like any other commit
+        BOOST_CHECK_EQUAL(get_current_epoch(), starting_epoch + 1);
+        BOOST_CHECK_EQUAL(trans.epoch(), starting_epoch + 1);
+        BOOST_CHECK_EQUAL(var.read(), 4);
+    }
+
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_read_only_commit )
+{
+    do_read_only_test<Versioned<int> >();
+    do_read_only_test<Versioned2<int> >();
+}
+
+template<class Var>
+void do_precheck_test()
+{
+    Var var(0);
+
+    auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> t2(new Transaction(false /* use_critical */));
+
+    current_trans = t1.get();
+    var.mutate() = 1;
+
+    current_trans = t2.get();
+    var.mutate() = 2;
+
+    // Nothing has been committed yet, so both could succeed
+    BOOST_CHECK(t1->precheck(t1->epoch()));
+    BOOST_CHECK(t2->precheck(t2->epoch()));
+
+    current_trans = t1.get();
+    BOOST_CHECK(t1->commit());
+    BOOST_CHECK_EQUAL(var.latest_valid_from(), get_current_epoch());
+
+    // Now t2 is doomed, and the precheck should know it
+    current_trans = t2.get();
+    BOOST_CHECK(!t2->precheck(t2->epoch()));
+    BOOST_CHECK(!t2->commit());
+    BOOST_CHECK_EQUAL(var.read(), 1);
+
+    current_trans = 0;
+}
+
+BOOST_AUTO_TEST_CASE( test_precheck )
+{
+    do_precheck_test<Versioned<int> >();
+    do_precheck_test<Versioned2<int> >();
+}
+
+template<class Var>
+void do_write_skew_test(bool serializable)
+{
+    Var x(0), y(0);
+
+    auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> t2(new Transaction(false /* use_critical */));
+
+    t1->set_serializable(serializable);
+    t2->set_serializable(serializable);
+
+    // Each one reads one variable and writes the other, which is fine for
+    // snapshot isolation but can't happen in any serial order
+    current_trans = t1.get();
+    y.mutate() = x.read() + 1;
+
+    current_trans = t2.get();
+    x.mutate() = y.read() + 1;
+
+    current_trans = t1.get();
+    BOOST_CHECK(t1->commit());
+
+    current_trans = t2.get();
+    BOOST_CHECK_EQUAL(t2->commit(), !serializable);
+
+    current_trans = 0;
+}
+
+BOOST_AUTO_TEST_CASE( test_write_skew )
+{
+    do_write_skew_test<Versioned<int> >(false);
+    do_write_skew_test<Versioned<int> >(true);
+    do_write_skew_test<Versioned2<int> >(false);
+    do_write_skew_test<Versioned2<int> >(true);
+}
+
+/// An object that doesn't know when it last changed
+struct Unknown_Object : public Versioned_Object {
+    virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * data)
+    {
+        return true;
+    }
+
+    virtual void commit(Epoch new_epoch) throw () {}
+    virtual void rollback(Epoch new_epoch, void * data) throw () {}
+    virtual void cleanup(Epoch unused_valid_from, Epoch trigger_epoch) {}
+
+    virtual Epoch rename_epoch(Epoch old_valid_from, Epoch new_valid_from)
+        throw ()
+    {
+        return 0;
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_serializable_reads )
+{
+    Versioned<int> x(0), y(0);
+    Unknown_Object unknown;
+
+    {
+        // Each object read is only tracked once
+        Local_Transaction trans;
+        trans.set_serializable(true);
+
+        for (unsigned i = 0;  i < 100;  ++i) {
+            x.read();
+            y.read();
+        }
+
+        BOOST_CHECK_EQUAL(trans.num_reads(), 2);
+        y.write(1);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        // We can't tell whether it changed, so we have to assume it did
+        Local_Transaction trans;
+        trans.set_serializable(true);
+
+        x.read();
+        trans.record_read(&unknown);
+        y.write(2);
+        BOOST_CHECK(!trans.commit());
+    }
+}
+
+/// Commits a transaction of its own that conflicts with ours, so that the
+/// first attempt fails
+struct Commit_Inside {
+    Commit_Inside(Versioned<int> & var) : var(var), calls(0)
+    {
+    }
+
+    void operator () ()
+    {
+        ++calls;
+        var.write(calls);
+
+        Local_Transaction inner;
+        var.write(-1);
+        inner.commit();
+    }
+
+    Versioned<int> & var;
+    int calls;
+};
+
+BOOST_AUTO_TEST_CASE( test_serialized_nested_commit )
+{
+    Versioned<int> var(0);
+    Commit_Inside fn(var);
+
+    Backoff_Policy policy;
+    policy.serialize_after = 1;
+
+    // Committing inside the serialized attempt would deadlock on the
+    // commit lock
+    BOOST_CHECK_THROW(run_transaction(boost::ref(fn), policy), Exception);
+    BOOST_CHECK_EQUAL(fn.calls, 2);
+    BOOST_CHECK(!commit_lock_held);
+    BOOST_CHECK_EQUAL(var.read(), -1);
+
+    // And the lock was released
+    {
+        Local_Transaction trans;
+        var.write(2);
+        BOOST_CHECK(trans.commit());
+    }
+}
+
+template<class Var>
+void do_priority_test()
+{
+    Var var(0);
+
+    auto_ptr<Transaction> low(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> high(new Transaction(false /* use_critical */));
+
+    high->set_priority(1);
+
+    // The high priority commit dooms the low priority writer
+    current_trans = low.get();
+    var.mutate() = 1;
+
+    current_trans = high.get();
+    var.mutate() = 2;
+
+    BOOST_CHECK(!low->doomed());
+    BOOST_CHECK(high->commit());
+    BOOST_CHECK(low->doomed());
+
+    current_trans = low.get();
+    BOOST_CHECK(!low->commit());
+    BOOST_CHECK(!low->doomed());
+
+    // The low priority commit gives way to the high priority writer, even
+    // though it would otherwise have succeeded
+    current_trans = low.get();
+    var.mutate() = 3;
+
+    current_trans = high.get();
+    var.mutate() = 4;
+
+    current_trans = low.get();
+    BOOST_CHECK(!low->commit());
+
+    current_trans = high.get();
+    BOOST_CHECK(high->commit());
+    BOOST_CHECK_EQUAL(var.read(), 4);
+
+    // Equal priorities behave as normal: first to commit wins.  The low
+    // transaction's snapshot is out of date, so start again.
+    low.reset();
+    low.reset(new Transaction(false /* use_critical */));
+    low->set_priority(1);
+
+    current_trans = low.get();
+    var.mutate() = 5;
+
+    current_trans = high.get();
+    var.mutate() = 6;
+
+    current_trans = low.get();
+    BOOST_CHECK(low->commit());
+
+    current_trans = high.get();
+    BOOST_CHECK(!high->commit());
+    BOOST_CHECK_EQUAL(var.read(), 5);
+
+    current_trans = 0;
+}
+
+BOOST_AUTO_TEST_CASE( test_priority )
+{
+    do_priority_test<Versioned<int> >();
+    do_priority_test<Versioned2<int> >();
+
+    // So that the other tests use the default commit path
+    disable_priorities();
+}
+
+BOOST_AUTO_TEST_CASE( test_immune )
+{
+    Versioned<int> var(0);
+
+    auto_ptr<Transaction> immune(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> high(new Transaction(false /* use_critical */));
+
+    immune->set_immune(true);
+    high->set_priority(1);
+
+    current_trans = immune.get();
+    var.mutate() = 1;
+
+    current_trans = high.get();
+    var.mutate() = 2;
+
+    // A higher priority can't doom an immune writer, so it gives way
+    BOOST_CHECK(!high->commit());
+    BOOST_CHECK(!immune->doomed());
+
+    current_trans = immune.get();
+    BOOST_CHECK(immune->commit());
+    BOOST_CHECK_EQUAL(var.read(), 1);
+
+    current_trans = 0;
+
+    disable_priorities();
+}
+
+template<class Var>
+void do_early_doom_test()
+{
+    enable_early_doom();
+
+    Var var(0);
+
+    auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> t2(new Transaction(false /* use_critical */));
+
+    current_trans = t1.get();
+    var.mutate() = 1;
+
+    current_trans = t2.get();
+    var.mutate() = 2;
+
+    BOOST_CHECK(!t1->doomed());
+    BOOST_CHECK(!t2->doomed());
+
+    current_trans = t1.get();
+    BOOST_CHECK(t1->commit());
+
+    // t2 can't commit any more, and should know it without trying
+    BOOST_CHECK(t2->doomed());
+
+    // A transaction that starts after the commit can still succeed
+    auto_ptr<Transaction> t3(new Transaction(false /* use_critical */));
+    current_trans = t3.get();
+    var.mutate() = 3;
+    BOOST_CHECK(!t3->doomed());
+
+    current_trans = t2.get();
+    BOOST_CHECK(!t2->commit());
+    BOOST_CHECK(!t2->doomed());
+
+    current_trans = t3.get();
+    BOOST_CHECK(t3->commit());
+    BOOST_CHECK_EQUAL(var.read(), 3);
+
+    current_trans = 0;
+}
+
+BOOST_AUTO_TEST_CASE( test_early_doom )
+{
+    do_early_doom_test<Versioned<int> >();
+    do_early_doom_test<Versioned2<int> >();
+
+    disable_early_doom();
+    BOOST_CHECK(!track_writers);
+}
+
+BOOST_AUTO_TEST_CASE( test_counter )
+{
+    Versioned_Counter<int> counter(5, 0, 10);
+
+    auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> t2(new Transaction(false /* use_critical */));
+
+    current_trans = t1.get();
+    counter.add(3);
+    BOOST_CHECK_EQUAL(counter.read(), 8);
+
+    current_trans = t2.get();
+    counter.add(2);
+    BOOST_CHECK_EQUAL(counter.read(), 7);
+
+    // Both started from the same snapshot, but neither conflicts
+    current_trans = t1.get();
+    BOOST_CHECK(t1->commit());
+
+    current_trans = t2.get();
+    BOOST_CHECK(t2->commit());
+    BOOST_CHECK_EQUAL(counter.read(), 10);
+
+    // Going over the top fails, and leaves the value alone
+    counter.increment();
+    BOOST_CHECK(!t2->commit());
+    BOOST_CHECK_EQUAL(counter.read(), 10);
+
+    counter.add(-10);
+    BOOST_CHECK(t2->commit());
+    BOOST_CHECK_EQUAL(counter.read(), 0);
+
+    counter.decrement();
+    BOOST_CHECK(!t2->commit());
+
+    current_trans = 0;
+
+    BOOST_CHECK_EQUAL(counter.read(), 0);
+}
+
+/// A set of ints that can be printed, as dumping a versioned object needs
+/// to print its values.  Its own type so that the operator is found
+/// without adding anything to namespace std.
+struct Int_Set : public std::set<int> {
+};
+
+std::ostream & operator << (std::ostream & stream, const Int_Set & s)
+{
+    stream << "{";
+    for (Int_Set::const_iterator it = s.begin();  it != s.end();  ++it)
+        stream << " " << *it;
+    return stream << " }";
+}
+
+BOOST_AUTO_TEST_CASE( test_merge )
+{
+    Versioned_Merge<int, Max_Merge<int> > watermark(5);
+    Versioned_Merge<Int_Set, Set_Merge<Int_Set> > s;
+
+    {
+        Local_Transaction trans;
+        s.mutate().insert(1);
+        s.mutate().insert(2);
+        BOOST_CHECK(trans.commit());
+    }
+
+    auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> t2(new Transaction(false /* use_critical */));
+
+    current_trans = t1.get();
+    watermark.write(7);
+    s.mutate().insert(3);
+
+    current_trans = t2.get();
+    watermark.write(6);
+    s.mutate().erase(1);
+    s.mutate().insert(4);
+
+    // Both commits succeed even though they conflict; the second is merged
+    // with the first
+    current_trans = t1.get();
+    BOOST_CHECK(t1->commit());
+
+    current_trans = t2.get();
+    BOOST_CHECK(t2->commit());
+
+    BOOST_CHECK_EQUAL(watermark.read(), 7);
+
+    Int_Set expected;
+    expected.insert(2);
+    expected.insert(3);
+    expected.insert(4);
+    BOOST_CHECK(s.read() == expected);
+
+    current_trans = 0;
+}
+
+template<class Var>
+void do_nested_test()
+{
+    Var x(0), y(0), z(0);
+
+    Epoch starting_epoch = get_current_epoch();
+    size_t starting_entries = snapshot_info.entry_count();
+
+    {
+        Local_Transaction trans;
+        x.mutate() = 1;
+
+        {
+            // Joins the outer transaction: no new snapshot is registered
+            Nested_Transaction nested;
+            BOOST_CHECK(nested.joined());
+            BOOST_CHECK_EQUAL(nested.transaction(), &trans);
+            BOOST_CHECK_EQUAL(current_trans, &trans);
+
+            x.mutate() = 2;
+            y.mutate() = 2;
+            BOOST_CHECK(nested.commit());
+        }
+
+        BOOST_CHECK_EQUAL(x.read(), 2);
+        BOOST_CHECK_EQUAL(y.read(), 2);
+
+        {
+            Nested_Transaction nested;
+            x.mutate() = 3;
+            z.mutate() = 3;
+
+            {
+                Nested_Transaction inner;
+                y.mutate() = 4;
+                inner.rollback();
+            }
+
+            BOOST_CHECK_EQUAL(y.read(), 2);
+            BOOST_CHECK_EQUAL(x.read(), 3);
+
+            // Destroyed without commit: rolled back
+        }
+
+        // Only the changes from the failed nested transaction are gone
+        BOOST_CHECK_EQUAL(x.read(), 2);
+        BOOST_CHECK_EQUAL(y.read(), 2);
+        BOOST_CHECK_EQUAL(z.read(), 0);
+        BOOST_CHECK_EQUAL(trans.num_local_values(), 2);
+
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(get_current_epoch(), starting_epoch + 1);
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), starting_entries);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(x.read(), 2);
+        BOOST_CHECK_EQUAL(y.read(), 2);
+        BOOST_CHECK_EQUAL(z.read(), 0);
+    }
+
+    // With no outer transaction, it has its own
+    {
+        Nested_Transaction nested;
+        BOOST_CHECK(!nested.joined());
+        z.mutate() = 5;
+        BOOST_CHECK(nested.commit());
+    }
+
+    Local_Transaction trans;
+    BOOST_CHECK_EQUAL(z.read(), 5);
+}
+
+BOOST_AUTO_TEST_CASE( test_nested )
+{
+    do_nested_test<Versioned<int> >();
+    do_nested_test<Versioned2<int> >();
+}
+
+BOOST_AUTO_TEST_CASE( test_large_write_set )
+{
+    // Enough objects to go past the inline storage, the linear scan and
+    // the first block of the arena
+    const size_t N = 1000;
+    Versioned<int> vars[N];
+
+    {
+        Local_Transaction trans;
+
+        for (unsigned i = 0;  i < N;  ++i)
+            vars[i].write(i);
+        for (unsigned i = 0;  i < N;  ++i)
+            vars[i].mutate() += 1;
+
+        BOOST_CHECK_EQUAL(trans.num_local_values(), N);
+        for (unsigned i = 0;  i < N;  ++i)
+            BOOST_CHECK_EQUAL(vars[i].read(), i + 1);
+
+        BOOST_CHECK(trans.commit());
+        BOOST_CHECK_EQUAL(trans.num_local_values(), 0);
+    }
+
+    Local_Transaction trans;
+    for (unsigned i = 0;  i < N;  ++i)
+        BOOST_CHECK_EQUAL(vars[i].read(), i + 1);
+}
+
+template<class Var>
+void do_reuse_on_retry_test()
+{
+    Var x(0), y(0);
+
+    auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> t2(new Transaction(false /* use_critical */));
+
+    t1->set_reuse_on_retry(true);
+
+    current_trans = t1.get();
+    x.mutate() = 1;
+    y.mutate() = 1;
+
+    current_trans = t2.get();
+    x.mutate() = 2;
+    BOOST_CHECK(t2->commit());
+
+    current_trans = t1.get();
+    BOOST_CHECK(!t1->commit());
+
+    // The old values are kept but can't be seen
+    BOOST_CHECK_EQUAL(t1->num_local_values(), 0);
+    BOOST_CHECK_EQUAL(x.read(), 2);
+    BOOST_CHECK_EQUAL(y.read(), 0);
+
+    // Only x is written this time; y must not be committed
+    x.mutate() += 10;
+    BOOST_CHECK_EQUAL(x.read(), 12);
+    BOOST_CHECK_EQUAL(t1->num_local_values(), 1);
+    BOOST_CHECK(t1->commit());
+
+    BOOST_CHECK_EQUAL(x.read(), 12);
+    BOOST_CHECK_EQUAL(y.read(), 0);
+
+    current_trans = 0;
+}
+
+BOOST_AUTO_TEST_CASE( test_reuse_on_retry )
+{
+    do_reuse_on_retry_test<Versioned<int> >();
+    do_reuse_on_retry_test<Versioned2<int> >();
+}
+
+/// Counts how many are alive and how many times they have been copied
+struct Counted {
+    Counted(int val = 0) : val(val) { ++alive; }
+    Counted(const Counted & other) : val(other.val) { ++alive;  ++copies; }
+    ~Counted() { --alive; }
+
+    Counted & operator = (const Counted & other)
+    {
+        val = other.val;
+        ++copies;
+        return *this;
+    }
+
+    void swap(Counted & other) { std::swap(val, other.val); }
+
+    int val;
+
+    static int alive;
+    static int copies;
+};
+
+int Counted::alive = 0;
+int Counted::copies = 0;
+
+void swap(Counted & c1, Counted & c2)
+{
+    c1.swap(c2);
+}
+
+std::ostream & operator << (std::ostream & stream, const Counted & c)
+{
+    return stream << c.val;
+}
+
+template<class Var>
+void do_no_copy_test(bool copies_history)
+{
+    {
+        Var var(Counted(1));
+        int alive_before = Counted::alive;
+
+        {
+            Local_Transaction trans;
+
+            // The first write copies the visible version once, straight
+            // into the sandbox
+            Counted::copies = 0;
+            var.mutate().val = 2;
+            BOOST_CHECK_EQUAL(Counted::copies, 1);
+            var.update(boost::bind(&Counted::swap, _1, Counted(3)));
+            BOOST_CHECK_EQUAL(var.read().val, 3);
+
+            Counted::copies = 0;
+            BOOST_CHECK(trans.commit());
+
+            // The value is taken from the sandbox, not copied.  Versioned2
+            // copies its whole history on each change, so we can only
+            // check Versioned.
+            if (!copies_history)
+                BOOST_CHECK_EQUAL(Counted::copies, 0);
+            BOOST_CHECK_EQUAL(var.read().val, 3);
+        }
+
+        // The local value was destroyed, and the old version cleaned up
+        BOOST_CHECK_EQUAL(Counted::alive, alive_before);
+    }
+
+    BOOST_CHECK_EQUAL(Counted::alive, 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_no_copy )
+{
+    do_no_copy_test<Versioned<Counted> >(false);
+    do_no_copy_test<Versioned2<Counted> >(true);
+}
+
+template<class Var>
+void do_last_writer_wins_test(bool lww)
+{
+    Var var(0);
+    var.set_last_writer_wins(lww);
+
+    auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> t2(new Transaction(false /* use_critical */));
+
+    current_trans = t1.get();
+    var.write(1);
+
+    current_trans = t2.get();
+    var.write(2);
+
+    current_trans = t1.get();
+    BOOST_CHECK(t1->commit());
+
+    // Normally t2 conflicts; with last writer wins it overwrites t1
+    current_trans = t2.get();
+    BOOST_CHECK_EQUAL(t2->commit(), lww);
+    BOOST_CHECK_EQUAL(var.read(), lww ? 2 : 1);
+
+    current_trans = 0;
+}
+
+BOOST_AUTO_TEST_CASE( test_last_writer_wins )
+{
+    do_last_writer_wins_test<Versioned<int> >(false);
+    do_last_writer_wins_test<Versioned<int> >(true);
+    do_last_writer_wins_test<Versioned2<int> >(false);
+    do_last_writer_wins_test<Versioned2<int> >(true);
+}
+
+BOOST_AUTO_TEST_CASE( test_read_cache )
+{
+    Versioned<int> var(1);
+
+    auto_ptr<Transaction> reader(new Transaction(false /* use_critical */));
+    reader->set_cache_reads(true);
+
+    current_trans = reader.get();
+    BOOST_CHECK_EQUAL(var.read(), 1);
+    BOOST_CHECK(reader->cached_read<int>(&var, reader->epoch()));
+
+    {
+        Local_Transaction writer;
+        var.write(2);
+        BOOST_CHECK(writer.commit());
+    }
+
+    // Still the version in our snapshot, found in the cache
+    current_trans = reader.get();
+    BOOST_CHECK_EQUAL(var.read(), 1);
+    BOOST_CHECK_EQUAL(var.read(), 1);
+
+    // Our own writes come before the cache
+    var.write(5);
+    BOOST_CHECK_EQUAL(var.read(), 5);
+
+    // The commit conflicts, and we restart with a new snapshot
+    BOOST_CHECK(!reader->commit());
+    BOOST_CHECK(!reader->cached_read<int>(&var, reader->epoch()));
+    BOOST_CHECK_EQUAL(var.read(), 2);
+
+    current_trans = 0;
+}
+
+template<class Var>
+void do_read_ref_test()
+{
+    Var var(Counted(1));
+
+    Local_Transaction reader;
+
+    Counted::copies = 0;
+    const Counted & ref = var.read_ref();
+    BOOST_CHECK_EQUAL(ref.val, 1);
+    BOOST_CHECK_EQUAL(Counted::copies, 0);
+
+    // Replacing the value doesn't affect what our snapshot refers to
+    {
+        Local_Transaction writer;
+        var.write(Counted(2));
+        BOOST_CHECK(writer.commit());
+    }
+
+    BOOST_CHECK_EQUAL(ref.val, 1);
+    BOOST_CHECK_EQUAL(var.read_ref().val, 1);
+
+    // Once written, we see our own value
+    var.write(Counted(3));
+    BOOST_CHECK_EQUAL(var.read_ref().val, 3);
+}
+
+BOOST_AUTO_TEST_CASE( test_read_ref )
+{
+    do_read_ref_test<Versioned<Counted> >();
+    do_read_ref_test<Versioned2<Counted> >();
+}
+
+/// Records which hooks have been run
+template<class T>
+void write_in_transaction(Versioned<T> & var, const T & value)
+{
+    Local_Transaction trans;
+    var.write(value);
+    if (!trans.commit())
+        throw Exception("write_in_transaction: commit failed");
+}
+
+struct Hook_Log {
+    Hook_Log() : committed(0), aborted(0), epoch(0)
+    {
+    }
+
+    void commit(Epoch e) { ++committed;  epoch = e; }
+    void abort() { ++aborted; }
+
+    int committed, aborted;
+    Epoch epoch;
+};
+
+BOOST_AUTO_TEST_CASE( test_hooks )
+{
+    Versioned<int> var(0);
+    Hook_Log log;
+
+    {
+        Local_Transaction trans;
+        var.write(1);
+        trans.on_commit(boost::bind(&Hook_Log::commit, &log, _1));
+        trans.on_abort(boost::bind(&Hook_Log::abort, &log));
+
+        // Thrown away with the work done inside
+        {
+            Nested_Transaction nested;
+            trans.on_commit(boost::bind(&Hook_Log::commit, &log, _1));
+            nested.rollback();
+        }
+
+        BOOST_CHECK(trans.commit());
+        BOOST_CHECK_EQUAL(log.committed, 1);
+        BOOST_CHECK_EQUAL(log.epoch, trans.epoch());
+        BOOST_CHECK_EQUAL(log.aborted, 0);
+    }
+
+    // A commit that fails runs the abort hooks and forgets the others
+    log = Hook_Log();
+    {
+        Local_Transaction trans;
+        var.write(2);
+        trans.on_commit(boost::bind(&Hook_Log::commit, &log, _1));
+        trans.on_abort(boost::bind(&Hook_Log::abort, &log));
+
+        {
+            Local_Transaction other;
+            var.write(3);
+            BOOST_CHECK(other.commit());
+        }
+
+        BOOST_CHECK(!trans.commit());
+        BOOST_CHECK_EQUAL(log.aborted, 1);
+
+        // Nothing is left to run on a retry
+        var.write(4);
+        BOOST_CHECK(trans.commit());
+        BOOST_CHECK_EQUAL(log.committed, 0);
+        BOOST_CHECK_EQUAL(log.aborted, 1);
+    }
+
+    // Never committed
+    log = Hook_Log();
+    {
+        Local_Transaction trans;
+        trans.on_abort(boost::bind(&Hook_Log::abort, &log));
+    }
+    BOOST_CHECK_EQUAL(log.aborted, 1);
+
+    // The hooks are told the epoch we committed at, even if something
+    // else has committed by the time they run
+    log = Hook_Log();
+    {
+        Local_Transaction trans;
+        var.write(5);
+        trans.on_commit(boost::bind(&Hook_Log::commit, &log, _1));
+
+        Epoch committed;
+        {
+            ACE_Write_Guard<Commit_Lock> guard(commit_lock);
+            committed = trans.commit_locked();
+        }
+        BOOST_CHECK(committed);
+        BOOST_CHECK_EQUAL(log.committed, 0);
+
+        boost::thread other(boost::bind(&write_in_transaction<int>,
+                                        boost::ref(var), 6));
+        other.join();
+        BOOST_CHECK_EQUAL(get_current_epoch(), committed + 1);
+
+        trans.run_hooks(committed);
+        BOOST_CHECK_EQUAL(log.committed, 1);
+        BOOST_CHECK_EQUAL(log.epoch, committed);
+    }
+}
+
+void do_large_commit_cleanup_test(Commit_Mode mode)
+{
+    set_commit_mode(mode);
+
+    const size_t N = 1000;
+    Versioned<int> vars[N];
+
+    {
+        // Keeps the old versions alive
+        Local_Transaction reader;
+        Epoch epoch = reader.epoch();
+
+        {
+            Local_Transaction writer;
+            for (unsigned i = 0;  i < N;  ++i)
+                vars[i].write(i + 1);
+            BOOST_CHECK(writer.commit());
+        }
+
+        // The whole batch was registered against the reader's snapshot
+        for (unsigned i = 0;  i < N;  ++i) {
+            BOOST_CHECK_EQUAL(snapshot_info.has_cleanup(epoch, &vars[i]), 1);
+            BOOST_CHECK_EQUAL(vars[i].history_size(), 1);
+            BOOST_CHECK_EQUAL(vars[i].read(), 0);
+        }
+    }
+
+    for (unsigned i = 0;  i < N;  ++i)
+        BOOST_CHECK_EQUAL(vars[i].history_size(), 0);
+
+    set_commit_mode(PARALLEL_COMMIT);
+}
+
+BOOST_AUTO_TEST_CASE( test_large_commit_cleanup )
+{
+    do_large_commit_cleanup_test(PARALLEL_COMMIT);
+    do_large_commit_cleanup_test(GROUP_COMMIT);
+}
+
+BOOST_AUTO_TEST_CASE( test_shared_snapshot_entry )
+{
+    size_t starting_entries = snapshot_info.entry_count();
+
+    auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+    auto_ptr<Transaction> t2(new Transaction(false /* use_critical */));
+
+    // Both join the entry for the current epoch
+    BOOST_CHECK_EQUAL(t1->epoch(), t2->epoch());
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), starting_entries + 1);
+
+    // Leaving when others are still there keeps the entry
+    t1.reset();
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), starting_entries + 1);
+
+    auto_ptr<Transaction> t3(new Transaction(false /* use_critical */));
+    BOOST_CHECK_EQUAL(t3->epoch(), t2->epoch());
+
+    t2.reset();
+    t3.reset();
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), starting_entries);
+}
+
+template<class Var>
+void do_snapshot_slots_test()
+{
+    snapshot_info.set_snapshot_slots(true);
+
+    {
+        Var var(1);
+
+        {
+            Local_Transaction reader;
+
+            {
+                Local_Transaction writer;
+                var.write(2);
+                BOOST_CHECK(writer.commit());
+            }
+
+            // Still needed by the reader
+            BOOST_CHECK_EQUAL(var.read(), 1);
+            BOOST_CHECK_EQUAL(var.history_size(), 1);
+            BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+        }
+
+        // The last snapshot to finish cleaned it up
+        BOOST_CHECK_EQUAL(var.history_size(), 0);
+
+        {
+            Local_Transaction trans;
+            BOOST_CHECK_EQUAL(var.read(), 2);
+        }
+    }
+
+    snapshot_info.set_snapshot_slots(false);
+}
+
+BOOST_AUTO_TEST_CASE( test_snapshot_slots )
+{
+    do_snapshot_slots_test<Versioned<int> >();
+    do_snapshot_slots_test<Versioned2<int> >();
+}
+
+void do_bounded_staleness_test(bool use_slots)
+{
+    snapshot_info.set_snapshot_slots(use_slots);
+
+    Versioned<int> var(1);
+
+    auto_ptr<Transaction> old(new Transaction(false /* use_critical */));
+    Epoch old_epoch = old->epoch();
+
+    {
+        Local_Transaction writer;
+        var.write(2);
+        BOOST_CHECK(writer.commit());
+    }
+
+    BOOST_CHECK_EQUAL(get_current_epoch(), old_epoch + 1);
+
+    {
+        // Recent enough to join the old snapshot
+        Local_Transaction stale(1);
+        BOOST_CHECK_EQUAL(stale.epoch(), old_epoch);
+        BOOST_CHECK_EQUAL(var.read(), 1);
+    }
+
+    {
+        // Not allowed to be stale at all
+        Local_Transaction fresh;
+        BOOST_CHECK_EQUAL(fresh.epoch(), old_epoch + 1);
+        BOOST_CHECK_EQUAL(var.read(), 2);
+    }
+
+    old.reset();
+
+    {
+        // Nothing to join any more
+        Local_Transaction stale(1);
+        BOOST_CHECK_EQUAL(stale.epoch(), old_epoch + 1);
+        BOOST_CHECK_EQUAL(var.read(), 2);
+    }
+
+    snapshot_info.set_snapshot_slots(false);
+}
+
+BOOST_AUTO_TEST_CASE( test_bounded_staleness )
+{
+    do_bounded_staleness_test(false);
+    do_bounded_staleness_test(true);
+}
+
+template<class Var>
+void do_lazy_registration_test()
+{
+    Var var1(1), var2(10);
+
+    size_t entries_before = snapshot_info.entry_count();
+
+    {
+        // Nothing changes, so there's never any need to register
+        Local_Transaction trans(REGISTER_LAZILY);
+        BOOST_CHECK(!trans.is_registered());
+        BOOST_CHECK_EQUAL(var1.read(), 1);
+        BOOST_CHECK_EQUAL(var2.read(), 10);
+        BOOST_CHECK(!trans.is_registered());
+        BOOST_CHECK_EQUAL(snapshot_info.entry_count(), entries_before);
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        // Something is committed before we read anything, so we can move
+        // on to the new epoch
+        Local_Transaction trans(REGISTER_LAZILY);
+        Epoch epoch = trans.epoch();
+
+        {
+            Local_Transaction writer;
+            var2.write(20);
+            BOOST_CHECK(writer.commit());
+        }
+
+        BOOST_CHECK_EQUAL(var2.read(), 20);
+        BOOST_CHECK(trans.is_registered());
+        BOOST_CHECK_EQUAL(trans.epoch(), epoch + 1);
+        BOOST_CHECK_EQUAL(var1.read(), 1);
+        BOOST_CHECK(!trans.doomed());
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        // Something is committed after we read, so what we read might
+        // not all be from the same epoch
+        Local_Transaction trans(REGISTER_LAZILY);
+        BOOST_CHECK_EQUAL(var1.read(), 1);
+
+        {
+            Local_Transaction writer;
+            var1.write(2);
+            var2.write(30);
+            BOOST_CHECK(writer.commit());
+        }
+
+        // Reading it would mix the two epochs, so it throws instead
+        BOOST_CHECK_THROW(var2.read(), Transaction_Restart);
+        BOOST_CHECK(trans.doomed());
+        BOOST_CHECK(!trans.commit());
+
+        // The retry is registered straight away and sees both changes
+        BOOST_CHECK(trans.is_registered());
+        BOOST_CHECK_EQUAL(var1.read(), 2);
+        BOOST_CHECK_EQUAL(var2.read(), 30);
+        BOOST_CHECK(trans.commit());
+
+        // Once that has worked it goes back to being lazy
+        BOOST_CHECK(!trans.is_registered());
+    }
+
+    {
+        // A read-only transaction carries on lazily after it commits
+        Local_Transaction trans(REGISTER_LAZILY);
+        BOOST_CHECK_EQUAL(var2.read(), 30);
+        BOOST_CHECK(trans.commit());
+
+        {
+            Local_Transaction writer;
+            var1.write(3);
+            BOOST_CHECK(writer.commit());
+        }
+
+        BOOST_CHECK_EQUAL(var1.read(), 3);
+        BOOST_CHECK(!trans.doomed());
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        // A retry that writes nothing but reads inconsistently must fail,
+        // even if its values from the last attempt are thrown away
+        Local_Transaction trans(REGISTER_LAZILY);
+        trans.set_reuse_on_retry(true);
+
+        var1.write(4);
+        trans.doom();
+        BOOST_CHECK(!trans.commit());
+        BOOST_CHECK(!trans.is_registered());
+
+        BOOST_CHECK_EQUAL(var1.read(), 3);
+
+        {
+            Local_Transaction writer;
+            var2.write(40);
+            BOOST_CHECK(writer.commit());
+        }
+
+        BOOST_CHECK_THROW(var2.read(), Transaction_Restart);
+        BOOST_CHECK(trans.doomed());
+        BOOST_CHECK(!trans.commit());
+    }
+
+    {
+        // Modifying something that has changed copies the new version
+        Local_Transaction trans(REGISTER_LAZILY);
+
+        {
+            Local_Transaction writer;
+            var1.write(3);
+            BOOST_CHECK(writer.commit());
+        }
+
+        var1.mutate() += 1;
+        BOOST_CHECK(trans.is_registered());
+        BOOST_CHECK(trans.commit());
+    }
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(var1.read(), 4);
+    }
+
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), entries_before);
+}
+
+BOOST_AUTO_TEST_CASE( test_lazy_registration )
+{
+    do_lazy_registration_test<Versioned<int> >();
+    do_lazy_registration_test<Versioned2<int> >();
+}
+
+/// An object whose setup() throws
+struct Throwing_Object : public Unknown_Object {
+    virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * data)
+    {
+        throw Exception("setup failed");
+    }
+};
+
+void do_setup_throws_test(Commit_Mode mode)
+{
+    set_commit_mode(mode);
+
+    Versioned<int> x(0), y(0);
+    Throwing_Object thrower;
+
+    Epoch starting_epoch = get_current_epoch();
+
+    {
+        Local_Transaction trans;
+        x.write(1);
+        y.write(1);
+        trans.local_value<int>(&thrower, 0);
+        BOOST_CHECK_THROW(trans.commit(), Exception);
+    }
+
+    // Nothing was committed, and the object locks and the epoch were
+    // given back; otherwise these would never finish
+    BOOST_CHECK_EQUAL(get_current_epoch(), starting_epoch);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(x.read(), 0);
+        BOOST_CHECK_EQUAL(y.read(), 0);
+        x.write(2);
+        y.write(2);
+        BOOST_CHECK(trans.commit());
+    }
+
+    BOOST_CHECK_EQUAL(get_current_epoch(), starting_epoch + 1);
+    BOOST_CHECK_EQUAL(x.history_size(), 0);
+
+    set_commit_mode(PARALLEL_COMMIT);
+}
+
+BOOST_AUTO_TEST_CASE( test_setup_throws )
+{
+    do_setup_throws_test(PARALLEL_COMMIT);
+    do_setup_throws_test(GROUP_COMMIT);
+}
+
+/// Writes a value, then runs a transaction of its own inside ours.  The
+/// first attempt is made to fail by a conflicting commit.
+struct Run_Nested {
+    Run_Nested(Versioned<int> & outer, Versioned<int> & inner)
+        : outer(outer), inner(inner), calls(0), inner_calls(0)
+    {
+    }
+
+    void operator () ()
+    {
+        ++calls;
+        outer.write(calls);
+        BOOST_CHECK(run_transaction(boost::bind(&Run_Nested::write_inner,
+                                                this)));
+
+        if (calls == 1) {
+            Local_Transaction other;
+            outer.write(-1);
+            other.commit();
+        }
+    }
+
+    void write_inner()
+    {
+        ++inner_calls;
+        inner.write(calls * 10);
+    }
+
+    Versioned<int> & outer;
+    Versioned<int> & inner;
+    int calls, inner_calls;
+};
+
+BOOST_AUTO_TEST_CASE( test_nested_run_transaction )
+{
+    Versioned<int> outer(0), inner(0);
+    Run_Nested fn(outer, inner);
+
+    Epoch starting_epoch = get_current_epoch();
+
+    Backoff_Policy policy;
+    policy.serialize_after = 1;
+
+    // The inner run joins ours, even in the serialized attempt where
+    // committing on its own would deadlock on the commit lock
+    BOOST_CHECK(run_transaction(boost::ref(fn), policy));
+    BOOST_CHECK_EQUAL(fn.calls, 2);
+    BOOST_CHECK_EQUAL(fn.inner_calls, 2);
+
+    // The conflicting commit, then ours; the inner work went with it
+    BOOST_CHECK_EQUAL(get_current_epoch(), starting_epoch + 2);
+
+    Local_Transaction trans;
+    BOOST_CHECK_EQUAL(outer.read(), 2);
+    BOOST_CHECK_EQUAL(inner.read(), 20);
+}
+
+template<class Var>
+void do_lazy_restart_test()
+{
+    // Transfers between the two always keep the total at 10
+    Var from(10), to(0);
+
+    Local_Transaction trans(REGISTER_LAZILY);
+
+    int attempts = 0;
+    for (bool committed = false;  !committed;) {
+        ++attempts;
+        try {
+            int total = from.read();
+
+            if (attempts == 1) {
+                Local_Transaction writer;
+                from.write(from.read() - 5);
+                to.write(to.read() + 5);
+                BOOST_CHECK(writer.commit());
+            }
+
+            total += to.read();
+
+            // Never half before and half after the transfer
+            BOOST_CHECK_EQUAL(total, 10);
+            committed = trans.commit();
+        } catch (const Transaction_Restart &) {
+            BOOST_CHECK(trans.doomed());
+            BOOST_CHECK(!trans.commit());
+        }
+    }
+
+    BOOST_CHECK_EQUAL(attempts, 2);
+}
+
+BOOST_AUTO_TEST_CASE( test_lazy_restart )
+{
+    do_lazy_restart_test<Versioned<int> >();
+    do_lazy_restart_test<Versioned2<int> >();
+}
+
+/// Commits a write to var, and to the thrower if there is one, noting
+/// what happened.  Runs in its own thread, so it doesn't check anything.
+struct Group_Committer {
+    Group_Committer(Versioned<int> & var, Versioned_Object * thrower = 0)
+        : var(var), thrower(thrower), committed(false), threw(false)
+    {
+    }
+
+    void run()
+    {
+        Local_Transaction trans;
+        var.write(1);
+        if (thrower) trans.local_value<int>(thrower, 0);
+
+        try {
+            committed = trans.commit();
+        } catch (const Exception &) {
+            threw = true;
+        }
+    }
+
+    Versioned<int> & var;
+    Versioned_Object * thrower;
+    bool committed, threw;
+};
+
+BOOST_AUTO_TEST_CASE( test_group_member_throws )
+{
+    set_commit_mode(GROUP_COMMIT);
+
+    Versioned<int> x(0), y(0), z(0);
+    Throwing_Object thrower;
+
+    Epoch starting_epoch = get_current_epoch();
+
+    Group_Committer first(x), bad(y, &thrower), good(z);
+
+    boost::thread_group tg;
+    {
+        // The first commit leads a group that waits for the lock, so the
+        // other two queue up behind it and are committed together.
+        // Whichever of them leads, only the one whose object threw should
+        // see the exception.
+        ACE_Write_Guard<Commit_Lock> guard(commit_lock);
+        tg.create_thread(boost::bind(&Group_Committer::run, &first));
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+        tg.create_thread(boost::bind(&Group_Committer::run, &bad));
+        tg.create_thread(boost::bind(&Group_Committer::run, &good));
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    }
+
+    tg.join_all();
+
+    BOOST_CHECK(first.committed);
+    BOOST_CHECK(!first.threw);
+    BOOST_CHECK(bad.threw);
+    BOOST_CHECK(!bad.committed);
+    BOOST_CHECK(good.committed);
+    BOOST_CHECK(!good.threw);
+
+    BOOST_CHECK_EQUAL(get_current_epoch(), starting_epoch + 2);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(x.read(), 1);
+        BOOST_CHECK_EQUAL(y.read(), 0);
+        BOOST_CHECK_EQUAL(z.read(), 1);
+    }
+
+    set_commit_mode(PARALLEL_COMMIT);
+}
+
+/// A value that is set up and then rolled back, as the object after it
+/// throws from its setup
+template<class Var>
+struct Rolled_Back {
+    Var var;
+    Throwing_Object thrower;
+};
+
+template<class Var>
+void do_rollback_leak_test()
+{
+    {
+        Rolled_Back<Var> objects;
+        int alive_before = Counted::alive;
+
+        {
+            Local_Transaction trans;
+            objects.var.write(Counted(2));
+            trans.local_value<int>(&objects.thrower, 0);
+            BOOST_CHECK_THROW(trans.commit(), Exception);
+        }
+
+        // Nothing was left behind by the rollback
+        BOOST_CHECK_EQUAL(Counted::alive, alive_before);
+
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(objects.var.read().val, 0);
+    }
+
+    BOOST_CHECK_EQUAL(Counted::alive, 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_rollback_leak )
+{
+    do_rollback_leak_test<Versioned<Counted> >();
+    do_rollback_leak_test<Versioned2<Counted> >();
+}
@@ -16,8 +16,10 @@ namespace JMVCC {
 /// Current transaction for this thread
 __thread Transaction * current_trans = 0;
 
-/// For the moment, only one commit can happen at a time
-ACE_Mutex commit_lock;
+/// Taken for reading by commits and for writing to stop all commits
+Commit_Lock commit_lock;
+
+__thread bool commit_lock_held = false;
 
 
 void no_transaction_exception(const Versioned_Object * obj)
@@ -30,23 +32,98 @@ void no_transaction_exception(const Versioned_Object * obj)
 /* TRANSACTION                                                               */
 /*****************************************************************************/
 
+Transaction::
+~Transaction()
+{
+    // Whatever is still waiting to be committed never will be.  We can't
+    // let an exception out of here.
+    try {
+        abort_hooks_from(0);
+    } catch (...) {
+    }
+}
+
 bool
 Transaction::
 commit()
 {
+    if (commit_lock_held)
+        throw Exception("commit() with the commit lock held for writing "
+                        "would deadlock");
+
+    // Writes are checked against our epoch, so it needs to be one that
+    // compress_epochs() knows about
+    if (num_local_values()) make_registered();
+    status = COMMITTING;
+    return finish_commit(Sandbox::commit(epoch()), true /* run_hooks */);
+}
+
+Epoch
+Transaction::
+commit_locked()
+{
+    if (num_local_values()) make_registered();
     status = COMMITTING;
-    Epoch result = Sandbox::commit(epoch());
+    return finish_commit(Sandbox::commit_locked(epoch()),
+                         false /* run_hooks */);
+}
+
+Epoch
+Transaction::
+finish_commit(Epoch result, bool run_hooks)
+{
     status = result ? COMMITTED : FAILED;
     if (!result) restart();
+    else resume_lazy_registration();
     
     if (use_critical)
         new_critical();
 
-    set_epoch(result);
+    // A read-only commit happens at our old epoch, but we still move on
+    // so that we see what has been committed since and don't hold back
+    // the cleanup of anything older
+    set_epoch(get_current_epoch());
+
+    // All of the locks taken to commit have now been released.  Our
+    // epoch has moved on by now, so the hooks are told where we
+    // committed instead.
+    if (run_hooks) this->run_hooks(result);
 
     return result;
 }
 
+void
+Transaction::
+run_hooks(Epoch committed_epoch)
+{
+    if (!committed_epoch) {
+        commit_hooks.clear();
+        abort_hooks_from(0);
+        return;
+    }
+
+    // Take them out first, in case a hook adds another or throws
+    std::vector<Commit_Hook> hooks;
+    hooks.swap(commit_hooks);
+    abort_hooks.clear();
+
+    for (unsigned i = 0;  i < hooks.size();  ++i)
+        hooks[i](committed_epoch);
+}
+
+void
+Transaction::
+abort_hooks_from(size_t n)
+{
+    if (abort_hooks.size() <= n) return;
+
+    std::vector<Abort_Hook> hooks(abort_hooks.begin() + n, abort_hooks.end());
+    abort_hooks.resize(n);
+
+    for (unsigned i = 0;  i < hooks.size();  ++i)
+        hooks[i]();
+}
+
 void
 Transaction::
 dump(std::ostream & stream, int indent)
@@ -58,5 +135,78 @@ dump(std::ostream & stream, int indent)
     Sandbox::dump(stream, indent);
 }
 
+
+
+/*****************************************************************************/
+/* NESTED_TRANSACTION                                                        */
+/*****************************************************************************/
+
+Nested_Transaction::
+Nested_Transaction()
+    : trans(current_trans), commit_hooks_size(0), abort_hooks_size(0),
+      finished(false)
+{
+    if (trans) {
+        savepoint = trans->savepoint();
+        commit_hooks_size = trans->commit_hooks.size();
+        abort_hooks_size = trans->abort_hooks.size();
+    }
+    else {
+        own.reset(new Local_Transaction());
+        trans = own.get();
+    }
+}
+
+Nested_Transaction::
+~Nested_Transaction()
+{
+    // Our own transaction throws its changes away when it is destroyed
+    if (joined() && !finished) {
+        try {
+            undo();
+        } catch (...) {
+        }
+    }
+}
+
+bool
+Nested_Transaction::
+commit()
+{
+    if (!joined()) return trans->commit();
+
+    if (finished)
+        throw Exception("nested transaction already finished");
+
+    trans->release(savepoint);
+    finished = true;
+    return true;
+}
+
+void
+Nested_Transaction::
+rollback()
+{
+    if (!joined()) {
+        trans->clear();
+        return;
+    }
+
+    if (finished)
+        throw Exception("nested transaction already finished");
+
+    finished = true;
+    undo();
+}
+
+void
+Nested_Transaction::
+undo()
+{
+    trans->rollback_to(savepoint);
+    trans->commit_hooks.resize(commit_hooks_size);
+    trans->abort_hooks_from(abort_hooks_size);
+}
+
 } // namespace JMVCC
 
@@ -11,6 +11,9 @@
 #include "snapshot.h"
 #include "sandbox.h"
 #include "garbage.h"
+#include <ace/RW_Mutex.h>
+#include <boost/function.hpp>
+#include <memory>
 
 
 namespace JMVCC {
@@ -22,11 +25,47 @@ extern __thread Transaction * current_trans;
 
 size_t current_trans_epoch();
 
-/// For the moment, only one commit can happen at a time
-extern ACE_Mutex commit_lock;
+/// Commits hold this for reading, so that as many as want to can run at
+/// once.  Anything that needs to stop all commits (for example, epoch
+/// compression) holds it for writing.
+typedef ACE_RW_Mutex Commit_Lock;
+extern Commit_Lock commit_lock;
+
+/// Is this thread holding the commit lock for writing through an
+/// Exclusive_Commit_Guard?  A commit() or a compress_epochs() would then
+/// deadlock, so they throw instead; commit_locked() has to be used.
+extern __thread bool commit_lock_held;
+
+/// Holds the commit lock for writing, and notes that this thread does
+struct Exclusive_Commit_Guard : boost::noncopyable {
+    Exclusive_Commit_Guard()
+        : guard(commit_lock)
+    {
+        commit_lock_held = true;
+    }
+
+    ~Exclusive_Commit_Guard()
+    {
+        commit_lock_held = false;
+    }
+
+    ACE_Write_Guard<Commit_Lock> guard;
+};
 
 void no_transaction_exception(const Versioned_Object * obj) __attribute__((__noreturn__));
 
+/** Thrown by a read in a transaction whose snapshot wasn't registered, when
+    what it read before has changed since and so can't be consistent with
+    what it would read now.  The transaction is doomed; its commit() will
+    fail and restart it, after which it can be run again. */
+struct Transaction_Restart : public Exception {
+    Transaction_Restart()
+        : Exception("transaction must be restarted: what it read lazily "
+                    "has changed")
+    {
+    }
+};
+
 
 
 /*****************************************************************************/
@@ -41,16 +80,100 @@ struct Transaction : public Snapshot, public Sandbox {
     {
     }
 
-    ~Transaction()
+    /// Transaction whose snapshot can be up to max_staleness epochs old
+    Transaction(bool use_critical, Epoch max_staleness)
+        : Snapshot(max_staleness), use_critical(use_critical)
+    {
+    }
+
+    /// Transaction whose snapshot may be registered lazily; see Snapshot
+    Transaction(bool use_critical, Registration registration)
+        : Snapshot(registration), use_critical(use_critical)
+    {
+    }
+
+    ~Transaction();
+
+    /** For a transaction whose snapshot isn't registered yet: call after
+        reading an object.  Returns true if what was read is right.
+        Otherwise the snapshot is now registered at the current epoch and
+        the object needs to be read again; if that makes what was read
+        earlier inconsistent, the transaction is doomed and
+        Transaction_Restart is thrown, so that the caller never sees a
+        mixture of the two. */
+    bool lazy_read()
+    {
+        if (check_lazy_read()) return true;
+        register_for_read();
+        return false;
+    }
+
+    /// Make sure that the snapshot is registered before reading from it.
+    /// Throws Transaction_Restart if it wasn't and what was read has
+    /// changed since, dooming the transaction.
+    void register_for_read()
     {
+        if (is_registered() || register_lazily()) return;
+        doom();
+        throw Transaction_Restart();
+    }
+
+    /// Make sure that the snapshot is registered, dooming the transaction
+    /// if it wasn't and what was read has changed since
+    void make_registered()
+    {
+        if (!is_registered() && !register_lazily()) doom();
     }
 
     bool commit();
 
+    /** Commit with the commit lock already held for writing.  Returns
+        the epoch that the transaction committed at, or zero if it failed.
+        The hooks aren't run, as they would be holding up every other
+        commit; call run_hooks() with the result once the lock has been
+        released. */
+    Epoch commit_locked();
+
+    typedef boost::function<void (Epoch)> Commit_Hook;
+    typedef boost::function<void ()> Abort_Hook;
+
+    /** Call hook with the epoch that this transaction committed at once
+        it has committed.
+        It is run after all of the locks taken by the commit have been
+        released.  If the commit fails, the hook is thrown away. */
+    void on_commit(const Commit_Hook & hook)
+    {
+        commit_hooks.push_back(hook);
+    }
+
+    /** Call hook if the commit fails, or if the transaction is destroyed
+        without committing.  If the commit succeeds, the hook is thrown
+        away. */
+    void on_abort(const Abort_Hook & hook)
+    {
+        abort_hooks.push_back(hook);
+    }
+
+    /** Run the hooks for a commit that succeeded at committed_epoch, or
+        failed if it is zero, and forget about the others.  Done
+        automatically by commit(). */
+    void run_hooks(Epoch committed_epoch);
+
     void dump(std::ostream & stream = std::cerr, int indent = 0);
 
     // Do we use critical sections?
     bool use_critical;
+
+private:
+    Epoch finish_commit(Epoch result, bool run_hooks);
+
+    std::vector<Commit_Hook> commit_hooks;
+    std::vector<Abort_Hook> abort_hooks;
+
+    /// Run the abort hooks registered after the first n, and forget them
+    void abort_hooks_from(size_t n);
+
+    friend class Nested_Transaction;
 };
 
 struct In_Out_Critical {
@@ -69,15 +192,72 @@ struct In_Out_Critical {
 /*****************************************************************************/
 /* LOCAL_TRANSACTION                                                         */
 /*****************************************************************************/
+
+/** A transaction that is current for as long as it is in scope.  It always
+    has a snapshot and sandbox of its own, even inside another transaction,
+    and commits independently of it; to join the outer transaction instead,
+    use a Nested_Transaction.
+*/
 struct Local_Transaction : public In_Out_Critical, public Transaction {
     Local_Transaction();
 
+    /// Local transaction whose snapshot can be up to max_staleness epochs
+    /// old; see Snapshot.
+    explicit Local_Transaction(Epoch max_staleness);
+
+    /// Local transaction whose snapshot may be registered lazily
+    explicit Local_Transaction(Registration registration);
+
     ~Local_Transaction();
 
     Transaction * old_trans;
 };
 
 
+/*****************************************************************************/
+/* NESTED_TRANSACTION                                                        */
+/*****************************************************************************/
+
+/** A transaction that joins the current one if there is one, instead of
+    making a new snapshot and sandbox of its own.  Its changes are then
+    committed (or not) along with those of the outer transaction; commit()
+    just keeps them.  If it is rolled back, or destroyed without being
+    committed, only the changes made since it started are undone, so the
+    outer transaction can carry on.  Commit hooks added since it started
+    are thrown away, and abort hooks are run.
+
+    If there is no current transaction, it behaves like a Local_Transaction.
+*/
+struct Nested_Transaction : boost::noncopyable {
+    Nested_Transaction();
+
+    ~Nested_Transaction();
+
+    /// Keep the changes.  When joined, always succeeds; the changes will
+    /// be committed by the outer transaction.
+    bool commit();
+
+    /// Undo the changes made since we started
+    void rollback();
+
+    /// Did we join an outer transaction?
+    bool joined() const { return !own.get(); }
+
+    /// The transaction that the work is being done in
+    Transaction * transaction() const { return trans; }
+
+private:
+    std::auto_ptr<Local_Transaction> own;
+    Transaction * trans;
+    Sandbox::Savepoint savepoint;
+    size_t commit_hooks_size, abort_hooks_size;  ///< When we were started
+    bool finished;
+
+    /// Undo the changes and hooks since we started
+    void undo();
+};
+
+
 } // namespace JMVCC
 
 #include "transaction_impl.h"
@@ -27,6 +27,24 @@ Local_Transaction()
     current_trans = this;
 }
 
+inline
+Local_Transaction::
+Local_Transaction(Epoch max_staleness)
+    : Transaction(true /* use_critical */, max_staleness)
+{
+    old_trans = current_trans;
+    current_trans = this;
+}
+
+inline
+Local_Transaction::
+Local_Transaction(Registration registration)
+    : Transaction(true /* use_critical */, registration)
+{
+    old_trans = current_trans;
+    current_trans = this;
+}
+
 inline
 Local_Transaction::
 ~Local_Transaction()
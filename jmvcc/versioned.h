@@ -37,6 +37,7 @@ struct Versioned : public Versioned_Object {
     typedef ACE_Mutex Mutex;
     
     explicit Versioned(const T & val = T())
+        : latest_valid_from_(1), last_writer_wins_(false), merged_(0)
     {
         Entry entry = new_entry(0, val);
         current = entry.value;
@@ -61,16 +62,26 @@ struct Versioned : public Versioned_Object {
         T * local = current_trans->local_value<T>(this);
 
         if (!local) {
-            T value;
             {
+                // Copy the visible version straight into the sandbox.  The
+                // lock stops it from being cleaned up while we do so.
                 ACE_Guard<Mutex> guard(lock);
                 //history.validate();
-                value = value_at_epoch(current_trans->epoch());
+                local = current_trans->local_value<T>
+                    (this, value_at_epoch(current_trans->epoch()));
             }
-            local = current_trans->local_value<T>(this, value);
 
             if (!local)
                 throw Exception("mutate(): no local was created");
+
+            // If our snapshot wasn't registered, we might have copied the
+            // wrong version; if so we are now registered and can copy the
+            // right one
+            if (JML_UNLIKELY(!current_trans->is_registered())
+                && !current_trans->lazy_read()) {
+                ACE_Guard<Mutex> guard(lock);
+                *local = value_at_epoch(current_trans->epoch());
+            }
         }
         
         return *local;
@@ -78,7 +89,18 @@ struct Versioned : public Versioned_Object {
 
     void write(const T & val)
     {
-        mutate() = val;
+        // No need to look at the old value if we're replacing it
+        if (!current_trans) no_transaction_exception(this);
+        T * local = current_trans->local_value<T>(this);
+        if (local) *local = val;
+        else current_trans->local_value<T>(this, val);
+    }
+
+    /// Modify the value in place by calling fn(value)
+    template<typename Fn>
+    void update(Fn fn)
+    {
+        fn(mutate());
     }
     
     const T read() const
@@ -87,18 +109,85 @@ struct Versioned : public Versioned_Object {
             ACE_Guard<Mutex> guard(lock);
             return value_at_epoch(get_current_epoch());
         }
-        
+
+        if (JML_UNLIKELY(!current_trans->is_registered())) {
+            const T * val = current_trans->local_value<T>(this);
+            if (val) return *val;
+
+            // Nothing stops the version we want from being cleaned up, so
+            // we copy it and then check that it was the right one
+            T result;
+            {
+                ACE_Guard<Mutex> guard(lock);
+                result = value_at_epoch(current_trans->epoch());
+            }
+
+            if (current_trans->lazy_read()) {
+                current_trans->record_read(this);
+                return result;
+            }
+        }
+
+        return read_ref();
+    }
+
+    /** Return a reference to the value that read() would copy.  It stays
+        valid until the transaction commits or is restarted, or until a
+        savepoint taken before the object was first written is rolled
+        back. */
+    const T & read_ref() const
+    {
+        if (!current_trans) no_transaction_exception(this);
+
+        // Only a registered snapshot keeps the version alive
+        if (JML_UNLIKELY(!current_trans->is_registered()))
+            current_trans->register_for_read();
+
         const T * val = current_trans->local_value<T>(this);
         
         if (val) return *val;
+
+        current_trans->record_read(this);
+
+        // The version we see can't be cleaned up while our snapshot is
+        // alive, so it's safe to hand out and to remember where it is
+        Epoch epoch = current_trans->epoch();
+        if (current_trans->cache_reads()) {
+            val = current_trans->cached_read<T>(this, epoch);
+            if (val) return *val;
+        }
      
         ACE_Guard<Mutex> guard(lock);
-        return value_at_epoch(current_trans->epoch());
+        val = &value_at_epoch(epoch);
+        if (current_trans->cache_reads())
+            current_trans->cache_read(this, epoch, val);
+        return *val;
     }
 
     size_t history_size() const { return history.size(); }
 
-private:
+    virtual Epoch latest_valid_from() const { return latest_valid_from_; }
+
+    /** Make the object last-writer-wins: a commit never conflicts with
+        one that happened since its snapshot, but simply replaces the
+        value.  Only makes sense for objects that are overwritten with
+        write() rather than modified. */
+    void set_last_writer_wins(bool lww) { last_writer_wins_ = lww; }
+
+    bool last_writer_wins() const { return last_writer_wins_; }
+
+    virtual bool precheck(Epoch old_epoch, void * data) const
+    {
+        return last_writer_wins_
+            || Versioned_Object::precheck(old_epoch, data);
+    }
+
+    virtual bool writes_conflict() const
+    {
+        return !last_writer_wins_;
+    }
+
+protected:
     // This structure provides a list of values.  Each one is tagged with the
     // earliest epoch in which it is valid.  The latest epoch in which it is
     // valid + 1 is that of the next entry in the list; that in current has no
@@ -121,6 +210,18 @@ private:
     History history;     ///< History of older values with epoch
     mutable Mutex lock;
 
+    /// Epoch from which the newest committed version is valid, readable
+    /// without taking the lock.  Only updated once a new version is
+    /// committed, never by a setup() that may yet be rolled back.
+    volatile Epoch latest_valid_from_;
+
+    bool last_writer_wins_;
+
+    /// Number of setups in the current (not yet committed) epoch that
+    /// replaced the value set up by an earlier member of the same group
+    /// rather than creating a new version.  Protected by the lock.
+    int merged_;
+
     Epoch valid_from() const { return (history.empty() ? 1 : history.back().valid_to); }
 
     /// Return the value for the given epoch
@@ -163,6 +264,21 @@ private:
         mutable bool used;
     };
 
+    /// Make a new entry with a default constructed value
+    Entry_Holder new_entry(Epoch valid_to)
+    {
+        T * value = allocator.allocate(1);
+        try {
+            new (value) T();
+        }
+        catch (...) {
+            allocator.deallocate(value, 1);
+            throw;
+        }
+
+        return Entry_Holder(valid_to, value);
+    }
+
     Entry_Holder new_entry(Epoch valid_to, const T & initial)
     {
         T * value = allocator.allocate(1);
@@ -186,6 +302,32 @@ private:
 
     static std::allocator<T> allocator;
 
+    /** Called by setup() with the lock held when another commit has
+        changed the value since our snapshot was taken.  base is the value
+        in our snapshot, theirs is the latest value and mine is the value
+        we want to commit.  To let the commit go ahead anyway, put the
+        value to commit into mine and return true.  The default can't
+        merge anything. */
+    virtual bool merge(const T & base, const T & theirs, T & mine) const
+    {
+        return false;
+    }
+
+    /// Make the given value the new current value from the given epoch.
+    /// The value is swapped in, leaving a default constructed value behind.
+    void install(Epoch new_epoch, T & value)
+    {
+        // We have to allocate the extra space in the history as nothing is
+        // allowed to fail in the commit or rollback.  We won't read from this
+        // entry as its epoch is higher than the current epoch.
+        history.push_back(Entry(new_epoch, current));
+        //valid_from = new_epoch;
+        Entry entry = new_entry(0);
+        using std::swap;
+        swap(*entry.value, value);
+        current = entry.value;
+    }
+
 public:
     // Implement object interface
 
@@ -193,20 +335,41 @@ public:
     {
         ACE_Guard<Mutex> guard(lock);
 
-        if (new_epoch != get_current_epoch() + 1)
-            throw Exception("epochs out of order");
+        T & mine = *reinterpret_cast<T *>(data);
+        using std::swap;
+
+        // A group commit might already have set up a new version in this
+        // epoch; if so we replace it rather than making another.  The
+        // replaced value goes back into the sandbox so that a rollback
+        // can restore it.
+        if (valid_from() == new_epoch) {
+            if (!last_writer_wins_) {
+                T merged = mine;
+                if (!merge(value_at_epoch(old_epoch), *current, merged))
+                    return false;
+                swap(merged, mine);
+            }
+            swap(*current, mine);
+            ++merged_;
+            return true;
+        }
 
-        if (valid_from() > old_epoch)
-            return false;  // something updated before us
+        if (new_epoch <= get_current_epoch())
+            throw Exception("epochs out of order");
 
-        // We have to allocate the extra space in the history as nothing is
-        // allowed to fail in the commit or rollback.  We won't read from this
-        // entry as its epoch is higher than the current epoch.
-        history.push_back(Entry(new_epoch, current));
-        //valid_from = new_epoch;
-        Entry entry = new_entry(0, *reinterpret_cast<T *>(data));
-        current = entry.value;
+        if (valid_from() > old_epoch && !last_writer_wins_) {
+            // Something updated before us.  See if our value can be merged
+            // with theirs; the snapshot at old_epoch is still alive so
+            // the value we started from is still there.
+            T merged = mine;
+            if (!merge(value_at_epoch(old_epoch), *current, merged))
+                return false;
+            install(new_epoch, merged);
+            return true;
+        }
 
+        // The sandbox has no more use for the value, so we take it
+        install(new_epoch, mine);
         return true;
     }
 
@@ -216,6 +379,17 @@ public:
         // 1.  We cleanup the first value on the history list
         ACE_Guard<Mutex> guard(lock);
 
+        // Updated here rather than in setup() so that a commit that then
+        // rolls back doesn't cause others to fail their prechecks
+        latest_valid_from_ = new_epoch;
+
+        // Only one of the members of a group that set up the new version
+        // registers the old one
+        if (merged_ > 0) {
+            --merged_;
+            return;
+        }
+
         // Register the new history entry to be cleaned up
         Epoch valid_from = (history.size() > 1 ? history[-2].valid_to : 1);
         snapshot_info.register_cleanup(this, valid_from);
@@ -236,11 +410,20 @@ public:
     {
         // Reverse the setup
         ACE_Guard<Mutex> guard(lock);
+
+        // Only the last member of a group to set up can be rolled back, so
+        // if anyone replaced the value in place it was us
+        if (merged_ > 0) {
+            using std::swap;
+            swap(*current, *reinterpret_cast<T *>(data));
+            --merged_;
+            return;
+        }
+
         Entry entry(0, current);
         cleanup_entry(entry);
         current = history.back().value;
         history.pop_back();
-        //valid_from = (history.empty() ? 0 : history.back().valid_to);
     }
 
     virtual void cleanup(Epoch unused_valid_from, Epoch trigger_epoch)
@@ -251,7 +434,11 @@ public:
             throw Exception("cleaning up with no values");
 
         if (unused_valid_from < history[0].valid_to) {
+            cleanup_entry(history[0]);
             history.pop_front();
+            // Dropping old versions doesn't change when the newest one
+            // became valid, unless there's nothing left to say so
+            if (history.empty()) latest_valid_from_ = 1;
             return;
         }
 
@@ -268,6 +455,7 @@ public:
                     last->valid_to = it->valid_to;
                 cleanup_entry(*it);
                 history.erase(it);
+                if (history.empty()) latest_valid_from_ = 1;
                 return;
             }
         }
@@ -321,6 +509,7 @@ public:
                                     "old 2");
                 
                 it->valid_to = new_valid_from;
+                latest_valid_from_ = valid_from();
 
                 if (i == history.size() - 2) {
                     ++it;
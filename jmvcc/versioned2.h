@@ -36,6 +36,7 @@ template<typename T>
 struct Versioned2 : public Versioned_Object {
 
     explicit Versioned2(const T & val = T())
+        : last_writer_wins_(false), merged_(0)
     {
         //static Info info;
         data = new_data(val, 1);
@@ -53,14 +54,19 @@ struct Versioned2 : public Versioned_Object {
         T * local = current_trans->local_value<T>(this);
 
         if (!local) {
-            T value;
-            {
-                value = get_data()->value_at_epoch(current_trans->epoch());
-            }
-            local = current_trans->local_value<T>(this, value);
+            // Copy the visible version straight into the sandbox.  Our
+            // critical section stops the data from being freed meanwhile.
+            local = current_trans->local_value<T>
+                (this, get_data()->value_at_epoch(current_trans->epoch()));
             
             if (!local)
                 throw Exception("mutate(): no local was created");
+
+            // Copy it again if it turns out that it wasn't the version
+            // that a snapshot that isn't registered should see
+            if (JML_UNLIKELY(!current_trans->is_registered())
+                && !current_trans->lazy_read())
+                *local = get_data()->value_at_epoch(current_trans->epoch());
         }
         
         return *local;
@@ -68,7 +74,18 @@ struct Versioned2 : public Versioned_Object {
 
     void write(const T & val)
     {
-        mutate() = val;
+        // No need to look at the old value if we're replacing it
+        if (!current_trans) no_transaction_exception(this);
+        T * local = current_trans->local_value<T>(this);
+        if (local) *local = val;
+        else current_trans->local_value<T>(this, val);
+    }
+
+    /// Modify the value in place by calling fn(value)
+    template<typename Fn>
+    void update(Fn fn)
+    {
+        fn(mutate());
     }
     
     const T read() const
@@ -78,14 +95,44 @@ struct Versioned2 : public Versioned_Object {
             //T result = d->value_at_epoch(get_current_epoch());
             //return result;
         }
+
+        if (JML_UNLIKELY(!current_trans->is_registered())) {
+            const T * val = current_trans->local_value<T>(this);
+            if (val) return *val;
+
+            // The version we want might already have been cleaned up, so
+            // we copy it and then check that it was the right one
+            T result = get_data()->value_at_epoch(current_trans->epoch());
+            if (current_trans->lazy_read()) {
+                current_trans->record_read(this);
+                return result;
+            }
+        }
+
+        return read_ref();
+    }
+
+    /** Return a reference to the value that read() would copy.  The
+        version that it refers to is freed once no critical section could
+        be looking at it, so the caller needs to be in one (as a
+        Local_Transaction is).  It stays valid until the transaction
+        commits or is restarted, or until a savepoint taken before the
+        object was first written is rolled back. */
+    const T & read_ref() const
+    {
+        if (!current_trans) no_transaction_exception(this);
+
+        // Only a registered snapshot keeps the version alive
+        if (JML_UNLIKELY(!current_trans->is_registered()))
+            current_trans->register_for_read();
+
         const T * val = current_trans->local_value<T>(this);
         
         if (val) return *val;
-        
-        const Data * d = get_data();
 
-        T result = d->value_at_epoch(current_trans->epoch());
-        return result;
+        current_trans->record_read(this);
+        
+        return get_data()->value_at_epoch(current_trans->epoch());
     }
 
     size_t history_size() const
@@ -94,6 +141,39 @@ struct Versioned2 : public Versioned_Object {
         return result;
     }
 
+    virtual Epoch latest_valid_from() const
+    {
+        // A version set up in an epoch that isn't published yet might
+        // still be rolled back, so it's skipped.  One published after we
+        // read the epoch is missed, which the contract allows.
+        Epoch current = get_current_epoch();
+        const Data * d = get_data();
+        for (int i = d->size() - 1;  i > 0;  --i) {
+            Epoch valid_from = d->element(i - 1).valid_to;
+            if (valid_from <= current) return valid_from;
+        }
+        return 1;
+    }
+
+    /** Make the object last-writer-wins: a commit never conflicts with
+        one that happened since its snapshot, but simply replaces the
+        value.  Only makes sense for objects that are overwritten with
+        write() rather than modified. */
+    void set_last_writer_wins(bool lww) { last_writer_wins_ = lww; }
+
+    bool last_writer_wins() const { return last_writer_wins_; }
+
+    virtual bool precheck(Epoch old_epoch, void * data) const
+    {
+        return last_writer_wins_
+            || Versioned_Object::precheck(old_epoch, data);
+    }
+
+    virtual bool writes_conflict() const
+    {
+        return !last_writer_wins_;
+    }
+
 private:
     // This structure provides a list of values.  Each one is tagged with the
     // earliest epoch in which it is valid.  The latest epoch in which it is
@@ -131,6 +211,13 @@ private:
 
         uint32_t size() const { return last - first; }
 
+        /// Epoch from which the newest entry is valid
+        Epoch valid_from() const
+        {
+            if (size() > 1) return element(size() - 2).valid_to;
+            return 1;
+        }
+
         ~Data()
         {
             size_t sz = size();
@@ -173,7 +260,7 @@ private:
             if (size() < 2)
                 throw Exception("popping back last element");
             --last;
-            // Need to: make sure that garbage collection runs its destructor
+            history[last].value.~T();
         }
 
         void push_back(const Entry & entry)
@@ -233,6 +320,14 @@ private:
     // The single internal data member.  Updated atomically.
     mutable Data * data;
 
+    bool last_writer_wins_;
+
+    /// Number of setups in the current (not yet committed) epoch that
+    /// replaced the value set up by an earlier member of the same group
+    /// rather than creating a new version.  Only group commits, which set
+    /// up and commit from a single thread, can do so.
+    int merged_;
+
     const Data * get_data() const
     {
         return reinterpret_cast<const Data *>(data);
@@ -290,53 +385,101 @@ private:
         return d2;
     }
 
-    bool set_data(const Data * & old_data, Data * new_data)
+    /// Atomically replace old_data with new_data.  On failure, old_data
+    /// is updated to the current data and new_data is left alone.
+    bool replace_data(const Data * & old_data, Data * new_data)
     {
-        // For the moment, the commit lock is held when we update this, so
-        // there is no possibility of conflict.  But if ever we decide to
-        // allow for parallel commits, then we need to be more careful here
-        // to do it atomically.
+        // The object's commit lock stops two commits from racing here, but
+        // cleanups and epoch renames can happen at the same time and so
+        // it needs to be done atomically.
         memory_barrier();
 
         bool result = cmp_xchg(reinterpret_cast<Data * &>(data),
                                const_cast<Data * &>(old_data),
                                new_data);
 
-        if (!result) delete_data_now(new_data);
-        else delete_data(const_cast<Data *>(old_data));
+        if (result) delete_data(const_cast<Data *>(old_data));
 
         return result;
     }
+
+    bool set_data(const Data * & old_data, Data * new_data)
+    {
+        bool result = replace_data(old_data, new_data);
+        if (!result) delete_data_now(new_data);
+        return result;
+    }
+
+    /// Swap value with that of the newest version
+    void swap_latest(T & value)
+    {
+        using std::swap;
+        const Data * d = get_data();
+
+        for (;;) {
+            Data * d2 = d->copy(d->size());
+            swap(d2->back().value, value);
+            if (replace_data(d, d2)) return;
+
+            // Someone cleaned up underneath us; try again
+            swap(d2->back().value, value);
+            delete_data_now(d2);
+        }
+    }
         
 public:
     // Implement object interface
 
     virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * new_value)
     {
+        // A group commit might already have set up a new version in this
+        // epoch, which only a last-writer-wins object can go on to replace
+        // (rather than making another).  The replaced value goes back
+        // into the sandbox so that a rollback can restore it.
+        if (get_data()->valid_from() == new_epoch) {
+            if (!last_writer_wins_) return false;
+            swap_latest(*reinterpret_cast<T *>(new_value));
+            ++merged_;
+            return true;
+        }
+
         for (;;) {
             const Data * d = get_data();
 
-            if (new_epoch != get_current_epoch() + 1)
+            if (new_epoch <= get_current_epoch())
                 throw Exception("epochs out of order");
             
-            Epoch valid_from = 1;
-            if (d->size() > 1)
-                valid_from = d->element(d->size() - 2).valid_to;
-            
-            if (valid_from > old_epoch)
+            if (d->valid_from() > old_epoch && !last_writer_wins_)
                 return false;  // something updated before us
             
             Data * new_data = d->copy(d->size() + 1);
             new_data->back().valid_to = new_epoch;
-            new_data->push_back(Entry(1 /* valid_to */,
-                                      *reinterpret_cast<T *>(new_value)));
-            
-            if (set_data(d, new_data)) return true;
+            new_data->push_back(Entry(1 /* valid_to */));
+
+            // The sandbox has no more use for the value, so we take it.
+            // Nobody else can see new_data until it's been swapped in.
+            using std::swap;
+            T & value = *reinterpret_cast<T *>(new_value);
+            swap(new_data->back().value, value);
+
+            if (replace_data(d, new_data)) return true;
+
+            // Someone cleaned up underneath us; give the value back and
+            // try again
+            swap(new_data->back().value, value);
+            delete_data_now(new_data);
         }
     }
 
     virtual void commit(Epoch new_epoch) throw ()
     {
+        // Only one of the members of a group that set up the new version
+        // registers the old one
+        if (merged_ > 0) {
+            --merged_;
+            return;
+        }
+
         const Data * d = get_data();
 
         // Now that it's definitive, we have an older entry to clean up
@@ -349,9 +492,18 @@ public:
 
     virtual void rollback(Epoch new_epoch, void * local_data) throw ()
     {
+        // Only the last member of a group to set up can be rolled back, so
+        // if anyone replaced the value in place it was us
+        if (merged_ > 0) {
+            swap_latest(*reinterpret_cast<T *>(local_data));
+            --merged_;
+            return;
+        }
+
 #if 1
         const Data * d = get_data();
 
+        // The copy's newest value goes with the entry that is dropped
         for (;;) {
             Data * d2 = d->copy(d->size());
             d2->pop_back();
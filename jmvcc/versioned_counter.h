@@ -0,0 +1,173 @@
+/* versioned_counter.h                                             -*- C++ -*-
+   Jeremy Barnes, 21 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   A versioned counter, where concurrent increments don't conflict.
+*/
+
+#ifndef __jmvcc__versioned_counter_h__
+#define __jmvcc__versioned_counter_h__
+
+#include "versioned.h"
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* VERSIONED_COUNTER                                                         */
+/*****************************************************************************/
+
+/** A versioned number that is only ever added to.  The sandbox holds the
+    amount to add rather than a new value, and the commit adds it to
+    whatever the latest value is at the time.  Two transactions that both
+    add to the counter therefore don't conflict, no matter which snapshot
+    they started from.
+
+    Optionally, the counter can be given bounds.  A commit that would take
+    the counter outside of them fails, as if it had conflicted.
+
+    Reading the counter gives the value in the snapshot plus the amount
+    added so far by this transaction.  A serializable transaction that
+    reads the counter will conflict with other commits to it as normal.
+*/
+
+template<typename T>
+struct Versioned_Counter : public Versioned<T> {
+    typedef Versioned<T> Base;
+    typedef typename Base::Mutex Mutex;
+
+    explicit Versioned_Counter(const T & val = T())
+        : Base(val), bounded(false)
+    {
+    }
+
+    Versioned_Counter(const T & val, const T & min_value, const T & max_value)
+        : Base(val), bounded(true), min_value(min_value),
+          max_value(max_value)
+    {
+    }
+
+    /// Add the given amount to the counter when the transaction commits
+    void add(const T & delta)
+    {
+        if (!current_trans) no_transaction_exception(this);
+        *current_trans->local_value<T>(this, T()) += delta;
+    }
+
+    void increment() { add(1); }
+
+    void decrement() { add(-1); }
+
+    const T read() const
+    {
+        if (!current_trans) {
+            ACE_Guard<Mutex> guard(this->lock);
+            return this->value_at_epoch(get_current_epoch());
+        }
+
+        current_trans->record_read(this);
+
+        T result;
+        for (;;) {
+            {
+                ACE_Guard<Mutex> guard(this->lock);
+                result = this->value_at_epoch(current_trans->epoch());
+            }
+
+            // An unregistered snapshot is registered if it read the wrong
+            // version, so the second time around is always right
+            if (JML_LIKELY(current_trans->is_registered())
+                || current_trans->lazy_read())
+                break;
+        }
+
+        const T * delta = current_trans->local_value<T>(this);
+        if (delta) result += *delta;
+
+        return result;
+    }
+
+private:
+    // Writing a whole value would be misinterpreted as an amount to add
+    using Base::mutate;
+    using Base::write;
+    using Base::update;
+
+    // Doesn't include what this transaction has added
+    using Base::read_ref;
+
+    bool bounded;
+    T min_value, max_value;
+
+public:
+    // Implement object interface
+
+    virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * data)
+    {
+        ACE_Guard<Mutex> guard(this->lock);
+
+        const T & delta = *reinterpret_cast<T *>(data);
+
+        // A group commit might already have set up a new version in this
+        // epoch; if so we add to it rather than making another
+        if (this->valid_from() == new_epoch) {
+            T new_value = *this->current + delta;
+            if (!in_bounds(new_value)) return false;
+            *this->current = new_value;
+            ++this->merged_;
+            return true;
+        }
+
+        if (new_epoch <= get_current_epoch())
+            throw Exception("epochs out of order");
+
+        // Unlike Versioned<T>, we don't care what happened since old_epoch,
+        // as the delta can be applied to anything
+        T new_value = *this->current + delta;
+        if (!in_bounds(new_value)) return false;
+
+        this->install(new_epoch, new_value);
+
+        return true;
+    }
+
+    virtual bool precheck(Epoch old_epoch, void * data) const
+    {
+        // Nothing that anyone else commits can make us conflict; only the
+        // bounds can make us fail and they need the lock to check
+        return true;
+    }
+
+    virtual bool writes_conflict() const
+    {
+        return false;
+    }
+
+    virtual void rollback(Epoch new_epoch, void * data) throw ()
+    {
+        {
+            ACE_Guard<Mutex> guard(this->lock);
+
+            // Our delta was added to the value in place
+            if (this->merged_ > 0) {
+                *this->current -= *reinterpret_cast<T *>(data);
+                --this->merged_;
+                return;
+            }
+        }
+
+        Base::rollback(new_epoch, data);
+    }
+
+private:
+    bool in_bounds(const T & value) const
+    {
+        return !bounded || (value >= min_value && value <= max_value);
+    }
+};
+
+} // namespace JMVCC
+
+
+#endif /* __jmvcc__versioned_counter_h__ */
@@ -0,0 +1,105 @@
+/* versioned_merge.h                                               -*- C++ -*-
+   Jeremy Barnes, 21 February 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Versioned objects that merge conflicting writes rather than failing.
+*/
+
+#ifndef __jmvcc__versioned_merge_h__
+#define __jmvcc__versioned_merge_h__
+
+#include "versioned.h"
+#include <algorithm>
+#include <set>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* VERSIONED_MERGE                                                           */
+/*****************************************************************************/
+
+/** A versioned object that, when another transaction has committed a new
+    value since our snapshot, asks a merge function to reconcile the two
+    instead of failing the commit.  The merge function is called as
+
+        bool merge(const T & base, const T & theirs, T & mine)
+
+    where base is the value in our snapshot, theirs is the latest committed
+    value and mine is what we want to commit.  It returns true once it has
+    put the merged value in mine, or false to fail the commit as usual.
+
+    It's called with the object locked, so it should be quick.
+*/
+
+template<typename T, class Merge>
+struct Versioned_Merge : public Versioned<T> {
+    typedef Versioned<T> Base;
+
+    explicit Versioned_Merge(const T & val = T(), const Merge & merge = Merge())
+        : Base(val), merge_fn(merge)
+    {
+    }
+
+    virtual bool precheck(Epoch old_epoch, void * data) const
+    {
+        // Any conflict might be able to be merged
+        return true;
+    }
+
+    virtual bool writes_conflict() const
+    {
+        return false;
+    }
+
+protected:
+    virtual bool merge(const T & base, const T & theirs, T & mine) const
+    {
+        return merge_fn(base, theirs, mine);
+    }
+
+private:
+    Merge merge_fn;
+};
+
+
+/*****************************************************************************/
+/* MERGE FUNCTIONS                                                           */
+/*****************************************************************************/
+
+/// Merge for a high watermark: the result is the larger of the two
+template<typename T>
+struct Max_Merge {
+    bool operator () (const T & base, const T & theirs, T & mine) const
+    {
+        mine = std::max(theirs, mine);
+        return true;
+    }
+};
+
+/// Merge for a std::set.  Whatever we inserted or erased relative to the
+/// base is inserted into or erased from their value.
+template<typename Set>
+struct Set_Merge {
+    bool operator () (const Set & base, const Set & theirs, Set & mine) const
+    {
+        Set result = theirs;
+
+        for (typename Set::const_iterator it = base.begin(), end = base.end();
+             it != end;  ++it)
+            if (!mine.count(*it)) result.erase(*it);
+
+        for (typename Set::const_iterator it = mine.begin(), end = mine.end();
+             it != end;  ++it)
+            if (!base.count(*it)) result.insert(*it);
+
+        mine.swap(result);
+        return true;
+    }
+};
+
+} // namespace JMVCC
+
+
+#endif /* __jmvcc__versioned_merge_h__ */
@@ -29,6 +29,27 @@ dump_unlocked(std::ostream & stream,
 {
 }
 
+Epoch
+Versioned_Object::
+latest_valid_from() const
+{
+    return 0;
+}
+
+bool
+Versioned_Object::
+precheck(Epoch old_epoch, void * data) const
+{
+    return latest_valid_from() <= old_epoch;
+}
+
+bool
+Versioned_Object::
+writes_conflict() const
+{
+    return true;
+}
+
 std::string
 Versioned_Object::
 print_local_value(void * val) const
@@ -11,6 +11,7 @@
 #include <iostream>
 #include <string>
 #include "jmvcc_defs.h"
+#include "spinlock.h"
 
 
 namespace JMVCC {
@@ -26,7 +27,9 @@ namespace JMVCC {
 struct Versioned_Object {
 
     // Get the commit ready and check that everything can go ahead, but
-    // don't actually perform the commit
+    // don't actually perform the commit.  The sandbox has no further use
+    // for the value in data, so its contents may be taken (swapped out)
+    // rather than copied.
     virtual bool setup(Epoch old_epoch, Epoch new_epoch, void * data) = 0;
 
     // Confirm a setup commit, making it permanent
@@ -38,6 +41,25 @@ struct Versioned_Object {
     // Clean up an unused version
     virtual void cleanup(Epoch unused_valid_from, Epoch trigger_epoch) = 0;
     
+    // Return the epoch from which the newest committed version of the
+    // object is valid; a version that is set up but might still be rolled
+    // back doesn't count.  This is called with no locks held and so may
+    // already be out of date when it returns; the default returns 0
+    // which means "unknown".  A serializable transaction that read an
+    // object that returns 0 can't tell whether it changed, and so always
+    // fails to commit.
+    virtual Epoch latest_valid_from() const;
+
+    // Opportunistically check whether a setup() of the given data could
+    // succeed, without taking any locks or allocating any memory.  If
+    // this returns false then setup() is certain to fail.
+    virtual bool precheck(Epoch old_epoch, void * data) const;
+
+    // Do two transactions that write the object at the same time conflict?
+    // Objects whose writes can always be combined return false, so that
+    // their writers aren't doomed or barged.
+    virtual bool writes_conflict() const;
+
     // Rename an epoch to a different number.  Returns the valid_from value
     // of the next epoch in the set.
     virtual Epoch rename_epoch(Epoch old_valid_from, Epoch new_valid_from)
@@ -49,6 +71,12 @@ struct Versioned_Object {
                                int indent = 0) const;
 
     virtual std::string print_local_value(void * val) const;
+
+    /// Held by the sandbox from the call to setup() until commit() or
+    /// rollback() has returned, so that only one commit at a time can
+    /// be working on the object.  Sandboxes take these locks in address
+    /// order to avoid deadlocks.
+    Spinlock object_commit_lock;
 };
 
 